@@ -3,7 +3,7 @@
 // Author      : Patrick Nguyen - 28586045
 // Author      : Bing Hui Feng - 78912993
 // Author      : Kevin Pham - 51044146
-// Version     : 
+// Version     :
 // Copyright   : Your copyright notice
 // Description : First Project Lab
 //============================================================================
@@ -12,11 +12,612 @@
 #include <string>
 #include <fstream>
 #include <cstdlib>
+#include <cstdio>
 #include <sstream>
 #include <vector>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
+#include <new>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <memory>
+#include <deque>
+#include <chrono>
+#include <stdint.h>
+
+#if __cplusplus >= 201703L
+#include <shared_mutex>
+#endif
+
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+// POSIX systems keep the working copy of the disk in a mapped scratch file; elsewhere the saved image is read and written whole.
+#if defined(__unix__) || defined(__APPLE__)
+#define FS53_MMAP_IMAGE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Linux can drive the image file through io_uring; the kernel header is enough, liburing is not needed.
+#if defined(__linux__) && defined(FS53_MMAP_IMAGE) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FS53_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
 using namespace std;
 
+// Binary disk image written by save() and read back by restore()
+static const char DISK_IMAGE[] = "savedFile.img";
+
+// Metadata journal kept next to DISK_IMAGE while ldisk is mapped
+static const char JOURNAL_IMAGE[] = "savedFile.img.journal";
+
+// Scratch file behind the mapped working copy, unlinked as soon as it is open
+static const char WORK_IMAGE[] = "savedFile.img.work";
+
+// Index of the lowest set bit of a non-zero 64-bit word.
+static inline int count_trailing_zeros(uint64_t word)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, word);
+	return (int)index;
+#else
+	return __builtin_ctzll(word);
+#endif
+}
+
+// Read a 4-byte integer field stored on disk.
+static inline int get_int(const char* p)
+{
+	int32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+// Store a 4-byte integer field on disk.
+static inline void put_int(char* p, int value)
+{
+	int32_t v = value;
+	memcpy(p, &v, sizeof(v));
+}
+
+// 64-bit FNV-1a hash of n bytes.
+static uint64_t fnv1a(const char* p, size_t n)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < n; i++)
+	{
+		hash ^= (unsigned char)p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+#if defined(FS53_MMAP_IMAGE)
+// Flush what was written to a file down to the device.
+static inline int sync_file(int fd)
+{
+#if defined(__APPLE__)
+	return fsync(fd);
+#else
+	return fdatasync(fd);
+#endif
+}
+
+// Write n bytes at 'offset', going round short writes.
+static bool write_at(int fd, const char* p, size_t n, off_t offset)
+{
+	while (n > 0)
+	{
+		ssize_t done = pwrite(fd, p, n, offset);
+		if (done <= 0)
+			return false;
+		p += done;
+		n -= (size_t)done;
+		offset += done;
+	}
+	return true;
+}
+
+// Create the scratch file for a working copy of 'bytes' bytes, filled from the start of 'source'
+// unless that is -1. Returns its descriptor, or -1.
+static int create_work_image(int source, size_t bytes)
+{
+	int fd = -1;
+#if defined(O_TMPFILE)
+	fd = ::open(".", O_TMPFILE | O_RDWR, 0600);
+#endif
+	if (fd < 0)
+	{
+		fd = ::open(WORK_IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0)
+			return -1;
+		unlink(WORK_IMAGE);
+	}
+	if (ftruncate(fd, (off_t)bytes) != 0)
+	{
+		::close(fd);
+		return -1;
+	}
+
+	off_t in = 0;
+	off_t out = 0;
+	size_t left = (source < 0) ? 0 : bytes;
+#if defined(__linux__) && defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 27)
+	// the kernel copies, and shares extents where the file system can
+	while (left > 0)
+	{
+		ssize_t n = copy_file_range(source, &in, fd, &out, left, 0);
+		if (n <= 0)
+			break;
+		left -= (size_t)n;
+	}
+#endif
+#endif
+	vector<char> buffer(left == 0 ? 0 : (1 << 20));
+	while (left > 0)
+	{
+		ssize_t n = pread(source, &buffer[0], (left < buffer.size()) ? left : buffer.size(), in);
+		if (n <= 0 || !write_at(fd, &buffer[0], (size_t)n, out))
+		{
+			::close(fd);
+			return -1;
+		}
+		in += n;
+		out += n;
+		left -= (size_t)n;
+	}
+	return fd;
+}
+#endif
+
+// Disk images at least this large are mapped so they can be backed by huge pages.
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Allocate a zeroed disk image of 'bytes' bytes, aligned to a cache line. Large images are mapped
+// with explicit huge pages when the system has them, otherwise with transparent huge pages advised.
+// 'mapped' tells free_disk_image() how the memory was obtained.
+static char* alloc_disk_image(size_t bytes, bool& mapped)
+{
+#if defined(__linux__)
+	if (bytes >= HUGE_PAGE_SIZE)
+	{
+		size_t length = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		void* p = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+		p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		if (p == MAP_FAILED)
+		{
+			p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#if defined(MADV_HUGEPAGE)
+			if (p != MAP_FAILED)
+				madvise(p, length, MADV_HUGEPAGE);
+#endif
+		}
+		if (p != MAP_FAILED)
+		{
+			mapped = true;
+			return (char*)p;
+		}
+	}
+#endif
+
+	mapped = false;
+	void* p;
+#if defined(_WIN32)
+	p = _aligned_malloc(bytes, 64);
+#else
+	if (posix_memalign(&p, 64, bytes) != 0)
+		p = NULL;
+#endif
+	if (p == NULL)
+		throw bad_alloc();
+	memset(p, '\0', bytes);
+	return (char*)p;
+}
+
+// Release an image returned by alloc_disk_image().
+static void free_disk_image(char* p, size_t bytes, bool mapped)
+{
+#if defined(__linux__)
+	if (mapped)
+	{
+		munmap(p, (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+		return;
+	}
+#else
+	(void)bytes;
+	(void)mapped;
+#endif
+#if defined(_WIN32)
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+// One destination buffer of a vectored read.
+struct IoVector
+{
+	char* mem_area;  // buffer to fill
+	int count;       // number of bytes wanted in it
+};
+
+// Reader/writer lock of an open file. Before C++17 there is no shared_mutex, so readers take it exclusively.
+#if __cplusplus >= 201703L
+typedef shared_mutex RwLock;
+#else
+struct RwLock : mutex
+{
+	void lock_shared() { lock(); }
+	void unlock_shared() { unlock(); }
+};
+#endif
+
+// Holds an RwLock in shared mode for a scope
+class ReadLock
+{
+	RwLock& rw;
+public:
+	explicit ReadLock(RwLock& lock) : rw(lock) { rw.lock_shared(); }
+	~ReadLock() { rw.unlock_shared(); }
+};
+
+// Completion of an asynchronous request: called with the number of bytes moved, or -1 on error
+typedef function<void(int)> IoCallback;
+
+// Asynchronous I/O engine under the emulated device. Requests may complete in any order and their
+// callbacks run on the engine's own threads.
+class AsyncIo
+{
+public:
+	virtual ~AsyncIo() {}
+
+	// Queue a transfer of 'length' bytes between 'data' and byte 'offset' of the device
+	virtual void submit(bool write, char* data, size_t length, uint64_t offset, IoCallback done) = 0;
+
+	virtual const char* name() const = 0;
+};
+
+// Fallback engine: a few worker threads that pread/pwrite the image file, or copy to and from the
+// disk array when there is no file.
+class ThreadPoolIo : public AsyncIo
+{
+	struct Request
+	{
+		bool write;
+		char* data;
+		size_t length;
+		uint64_t offset;
+		IoCallback done;
+	};
+
+	char* base;  // the disk array, used when fd is -1
+	int fd;
+	vector<thread> workers;
+	mutex lock;
+	condition_variable ready;
+	deque<Request> queue;
+	bool stopping;
+
+	void run()
+	{
+		for (;;)
+		{
+			Request request;
+			{
+				unique_lock<mutex> guard(lock);
+				while (queue.empty() && !stopping)
+					ready.wait(guard);
+				if (queue.empty())
+					return;
+				request = queue.front();
+				queue.pop_front();
+			}
+			request.done(transfer(request));
+		}
+	}
+
+	int transfer(const Request& request)
+	{
+#if defined(FS53_MMAP_IMAGE)
+		if (fd >= 0)
+		{
+			size_t moved = 0;
+			while (moved < request.length)
+			{
+				ssize_t n = request.write
+					? pwrite(fd, request.data + moved, request.length - moved, (off_t)(request.offset + moved))
+					: pread(fd, request.data + moved, request.length - moved, (off_t)(request.offset + moved));
+				if (n <= 0)
+					return -1;
+				moved += (size_t)n;
+			}
+			return (int)moved;
+		}
+#endif
+		if (request.write)
+			memcpy(base + request.offset, request.data, request.length);
+		else
+			memcpy(request.data, base + request.offset, request.length);
+		return (int)request.length;
+	}
+
+public:
+	ThreadPoolIo(char* disk, int file, int threads) : base(disk), fd(file), stopping(false)
+	{
+		for (int i = 0; i < threads; i++)
+			workers.push_back(thread(&ThreadPoolIo::run, this));
+	}
+
+	// finishes every queued request first
+	~ThreadPoolIo()
+	{
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		ready.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	void submit(bool write, char* data, size_t length, uint64_t offset, IoCallback done)
+	{
+		Request request = { write, data, length, offset, done };
+		{
+			lock_guard<mutex> guard(lock);
+			queue.push_back(request);
+		}
+		ready.notify_one();
+	}
+
+	const char* name() const { return "thread pool"; }
+};
+
+#if defined(FS53_IO_URING)
+// io_uring engine on the image file, driven through the raw system calls. Submitters share the
+// submission queue under a lock; one reaper thread waits for completions and runs the callbacks.
+class UringIo : public AsyncIo
+{
+	struct Request
+	{
+		bool write;
+		char* data;
+		size_t length;
+		uint64_t offset;
+		size_t moved;
+		IoCallback done;
+	};
+
+	int ringFd;
+	int fd;
+	unsigned entries;
+	void* sqRing;
+	size_t sqRingSize;
+	void* cqRing;
+	size_t cqRingSize;
+	io_uring_sqe* sqes;
+	size_t sqesSize;
+	unsigned* sqTail;
+	unsigned sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	io_uring_cqe* cqes;
+
+	mutex lock;
+	condition_variable space;  // signalled when requests complete
+	unsigned inFlight;         // kept at most 'entries', so the completion queue never overflows
+	thread reaper;
+
+	static int enter(int ring, unsigned toSubmit, unsigned minComplete, unsigned flags)
+	{
+		return (int)syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, NULL, 0);
+	}
+
+	UringIo() : ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes((io_uring_sqe*)MAP_FAILED), inFlight(0) {}
+
+	// Queue one SQE for 'request' (NULL wakes the reaper up to stop). The caller holds 'lock'.
+	void push(Request* request)
+	{
+		unsigned tail = *sqTail;
+		unsigned index = tail & sqMask;
+		io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		if (request == NULL)
+			sqe->opcode = IORING_OP_NOP;
+		else
+		{
+			sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = fd;
+			sqe->addr = (uint64_t)(uintptr_t)(request->data + request->moved);
+			sqe->len = (uint32_t)(request->length - request->moved);
+			sqe->off = request->offset + request->moved;
+		}
+		sqe->user_data = (uint64_t)(uintptr_t)request;
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		inFlight++;
+		enter(ringFd, 1, 0, 0);
+	}
+
+	void reap()
+	{
+		for (;;)
+		{
+			enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS);
+
+			unsigned head = *cqHead;
+			unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+			vector<pair<Request*, int> > finished;
+			bool stop = false;
+			for (; head != tail; head++)
+			{
+				const io_uring_cqe& cqe = cqes[head & cqMask];
+				Request* request = (Request*)(uintptr_t)cqe.user_data;
+				if (request == NULL)
+					stop = true;
+				else
+					finished.push_back(make_pair(request, cqe.res));
+			}
+			__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+			// the requests were queued under the lock; taking it orders their fields before the reads below,
+			// which the hand-over through the kernel does not do as far as the memory model is concerned
+			{
+				lock_guard<mutex> guard(lock);
+			}
+
+			for (size_t i = 0; i < finished.size(); i++)
+			{
+				Request* request = finished[i].first;
+				int result = finished[i].second;
+
+				// a short transfer is queued again for the rest
+				if (result > 0 && request->moved + result < request->length)
+				{
+					request->moved += result;
+					lock_guard<mutex> guard(lock);
+					inFlight--;
+					push(request);
+					continue;
+				}
+
+				request->done((result < 0) ? -1 : (result == 0 ? (int)request->moved : (int)(request->moved + result)));
+				delete request;
+				{
+					lock_guard<mutex> guard(lock);
+					inFlight--;
+				}
+				space.notify_all();
+			}
+			if (stop)
+				return;
+		}
+	}
+
+public:
+	// An engine on 'file', or NULL if the kernel does not offer io_uring
+	static UringIo* create(int file, unsigned queueDepth)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		int ring = (int)syscall(__NR_io_uring_setup, queueDepth, &params);
+		if (ring < 0)
+			return NULL;
+
+		UringIo* io = new UringIo();
+		io->ringFd = ring;
+		io->fd = file;
+		io->entries = params.sq_entries;
+
+		io->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		io->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			if (io->cqRingSize > io->sqRingSize)
+				io->sqRingSize = io->cqRingSize;
+			io->cqRingSize = io->sqRingSize;
+		}
+
+		io->sqRing = mmap(NULL, io->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+		if (io->sqRing != MAP_FAILED)
+		{
+			io->cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? io->sqRing
+				: mmap(NULL, io->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+			io->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+			io->sqes = (io_uring_sqe*)mmap(NULL, io->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+		}
+		if (io->sqRing == MAP_FAILED || io->cqRing == MAP_FAILED || io->sqes == MAP_FAILED)
+		{
+			delete io;
+			return NULL;
+		}
+
+		char* sq = (char*)io->sqRing;
+		char* cq = (char*)io->cqRing;
+		io->sqTail = (unsigned*)(sq + params.sq_off.tail);
+		io->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+		io->sqArray = (unsigned*)(sq + params.sq_off.array);
+		io->cqHead = (unsigned*)(cq + params.cq_off.head);
+		io->cqTail = (unsigned*)(cq + params.cq_off.tail);
+		io->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+		io->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+		io->reaper = thread(&UringIo::reap, io);
+		return io;
+	}
+
+	// waits for every request in flight
+	~UringIo()
+	{
+		if (reaper.joinable())
+		{
+			{
+				unique_lock<mutex> guard(lock);
+				while (inFlight != 0)
+					space.wait(guard);
+				push(NULL);
+			}
+			reaper.join();
+		}
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqesSize);
+		if (cqRing != MAP_FAILED && cqRing != sqRing)
+			munmap(cqRing, cqRingSize);
+		if (sqRing != MAP_FAILED)
+			munmap(sqRing, sqRingSize);
+		if (ringFd >= 0)
+			::close(ringFd);
+	}
+
+	void submit(bool write, char* data, size_t length, uint64_t offset, IoCallback done)
+	{
+		Request* request = new Request();
+		request->write = write;
+		request->data = data;
+		request->length = length;
+		request->offset = offset;
+		request->moved = 0;
+		request->done = done;
+
+		unique_lock<mutex> guard(lock);
+		while (inFlight >= entries)
+			space.wait(guard);
+		push(request);
+	}
+
+	const char* name() const { return "io_uring"; }
+};
+#endif
+
 class FileSystem53 {
 
 	int B;  //Block length
@@ -24,30 +625,318 @@ class FileSystem53 {
 	char** desc_table;  // Descriptor Table (in memory).
 	// This is aka cache. It's contents should be
 	// maintained to be same as first K blocks in disk.
-	// Descriptor table format:
-	// +-------------------------------------+
-	// | bitmap | dsc_0 | dsc_1 | .. | dsc_N |
-	// +-------------------------------------+
-	//   bitmap: Each bit represent a block in a disk. MAX_BLOCK_NO/8 bytes
+	// Disk format:
+	// +-------------------------------------------------------------+
+	// | superblock | bitmap | dsc_0 | dsc_1 | .. | dsc_N | data ... |
+	// +-------------------------------------------------------------+
+	//   superblock: Block 0. Geometry chosen at format time (SB_* fields, 4 bytes each).
+	//   bitmap: Each bit represent a block in a disk. blockCount/8 bytes, rounded up to whole blocks.
 	//   dsc_0 : Root directory descriptor
-	//   dsc_i : i'th descriptor. Each descriptor is FILE_SIZE_FIELD+ARRAY_SIZE bytes long.
+	//   dsc_i : i'th descriptor. Each descriptor is DESCR_SIZE bytes long:
+	//           +------+-----------------------+-----------------+-----------------+
+	//           | size | ARRAY_SIZE direct blk | single indirect | double indirect |
+	//           +------+-----------------------+-----------------+-----------------+
+	//           K blocks hold descriptorCount descriptors, B/DESCR_SIZE per block.
+	//           An indirect block holds B/BLOCK_NO_SIZE block numbers; a double indirect block points at
+	//           B/BLOCK_NO_SIZE single indirect blocks. Block number 0 means "not allocated".
 
 	// Filesystem format parameters:
-	static const int FILE_SIZE_FIELD = 1;     // Size of file size field in bytes. Maximum file size allowed in this file system is 192.
-	static const int ARRAY_SIZE = 3;          // The length of array of disk block numbers that hold the file contents.
-	static const int DESCR_SIZE = FILE_SIZE_FIELD + ARRAY_SIZE;
-	static const int MAX_FILE_NO = 14;        // Maximum number of files which can be stored by this file system.
-	static const int MAX_BLOCK_NO = 64;       // Maximum number of blocks which can be supported by this file system.
+	static const int FILE_SIZE_FIELD = 4;     // Size of file size field in bytes.
+	static const int BLOCK_NO_SIZE = 4;       // Size of a disk block number in bytes.
+	static const int ARRAY_SIZE = 3;          // The length of array of direct disk block numbers that hold the file contents.
+	static const int SINGLE_INDIRECT = FILE_SIZE_FIELD + ARRAY_SIZE * BLOCK_NO_SIZE; // Offset of the single indirect block number.
+	static const int DOUBLE_INDIRECT = SINGLE_INDIRECT + BLOCK_NO_SIZE;              // Offset of the double indirect block number.
+	static const int DESCR_SIZE = DOUBLE_INDIRECT + BLOCK_NO_SIZE;
+	static const int MAX_FILE_NO = 14;        // Default maximum number of files which can be stored by this file system.
+	static const int MAX_BLOCK_NO = 64;       // Default number of blocks of a newly formatted disk.
 	static const int MAX_BLOCK_NO_DIV8 = MAX_BLOCK_NO / 8;
-	static const int MAX_FILE_NAME_LEN = 32;  // Maximum size of file name in byte.
-	static const int MAX_OPEN_FILE = 3;       // Maximum number of files to open at the same time.
-	static const int FILEIO_BUFFER_SIZE = 64; // Size of file io bufer
+	static const int MAX_FILE_NAME_LEN = 10;  // Default maximum size of file name in byte.
+	static const int MAX_OPEN_FILE = 3;       // Default maximum number of files to open at the same time.
 	static const int _EOF = -1;       // End-of-File
 
-	char** ldisk;
-	static const int l = 64;
-	int* oftAllocation;
-	 char OFTable[3][l + 2];
+	// Superblock fields (index of each 4-byte field in block 0)
+	static const int SB_MAGIC = 0;
+	static const int SB_BLOCK_SIZE = 1;
+	static const int SB_BLOCK_COUNT = 2;
+	static const int SB_DESCRIPTORS = 3;
+	static const int SB_OPEN_FILES = 4;
+	static const int SB_NAME_LEN = 5;
+	static const int SB_BITMAP_START = 6;
+	static const int SB_BITMAP_BLOCKS = 7;
+	static const int SB_DESC_START = 8;
+	static const int SB_DESC_BLOCKS = 9;
+	static const int SB_DATA_START = 10;
+	static const int SB_FIELDS = 11;
+	static const int FS_MAGIC = 0x33355346;   // "FS53"
+
+	// Geometry of the mounted disk. Read from the superblock.
+	int blockCount;       // Number of blocks on the disk.
+	int descriptorCount;  // Number of descriptors, including the root directory.
+	int maxOpenFiles;     // Initial number of open file table entries. The table grows past it on demand.
+	int nameLength;       // Maximum size of file name in byte.
+	int bitmapStart;      // First bitmap block.
+	int bitmapBlocks;     // Number of bitmap blocks.
+	int descStart;        // First descriptor block. The descriptor table is K blocks long.
+	int dataStart;        // First block handed out by the allocator.
+	int dirEntrySize;     // Directory entry: nameLength bytes of name + descriptor number.
+	int maxFileBlocks;    // Number of logical blocks reachable from a descriptor, capped so sizes fit in an int.
+
+	char* ldisk;        // The whole disk in one contiguous buffer. Block i starts at ldisk + i * B.
+	size_t diskBytes;   // blockCount * B
+	bool diskMapped;    // ldisk came from mmap, see alloc_disk_image()
+	int imageFd;        // Scratch file ldisk is a shared mapping of, -1 while ldisk is plain memory
+	bool* blockDirty;  // Block changed since the image was last saved or restored.
+	vector<int> dirtyBlocks;  // Blocks with blockDirty set, in the order they were first changed.
+	bool imageCurrent;  // DISK_IMAGE holds ldisk apart from the dirty blocks, so save() only writes those.
+
+	// Buffer cache between the file system and ldisk, used by the block views. Frames are picked for
+	// eviction with CLOCK; a dirty frame goes back to ldisk when it is evicted or on sync().
+	// read_block()/write_block() use a cached copy when there is one but do not fill frames.
+	static const int CACHE_FRAMES = 16;  // Default number of frames.
+	int cacheFrames;
+	char* cacheData;                      // cacheFrames * B bytes, frame f at cacheData + f * B
+	int* cacheBlock;                      // Block held by each frame, -1 if the frame is empty.
+	bool* cacheFrameDirty;                // Frame differs from ldisk.
+	bool* cacheReferenced;                // CLOCK reference bit.
+	int clockHand;
+	unordered_map<int, int> cacheIndex;   // block -> frame
+
+	// Asynchronous I/O engine on the device, started on first use and stopped whenever ldisk changes:
+	// io_uring on the image file where the kernel has it, a thread pool otherwise.
+	// Submitters go through submit_io(), which counts them in ioUsers, so stop_io() never deletes the
+	// engine under a thread that is still handing it a request.
+	static const int IO_QUEUE_DEPTH = 64;
+	AsyncIo* ioEngine;
+	mutex ioLock;
+	int ioUsers;
+	condition_variable ioIdle;  // signalled when ioUsers drops to 0
+
+	// Counts down the requests of a batch
+	struct IoBatch
+	{
+		mutex lock;
+		condition_variable done;
+		int pending;
+		bool failed;
+	};
+
+	// A recursive mutex that lets the file system know when its outermost hold ends, which closes a
+	// journal transaction
+	class MetaMutex
+	{
+	public:
+		explicit MetaMutex(FileSystem53* fs) : owner(fs), depth(0) {}
+		void lock() { held.lock(); depth++; }
+		void unlock()
+		{
+			if (depth == 1)
+				owner->end_transaction();
+			depth--;
+			held.unlock();
+		}
+
+	private:
+		recursive_mutex held;
+		FileSystem53* owner;
+		int depth;   // holds by the owning thread
+	};
+
+	// Locking. Any number of threads may share one file system; format, mount, restore, set_cache_size
+	// and OpenFileTable must not run concurrently with anything else. Locks are always taken in this order:
+	//   OFT entry lock -> ActiveFile lock -> metaLock -> Process lock -> tableLock
+	//   metaLock -> journalLock -> journalQueueLock
+	// metaLock covers the buffer cache, descriptors, indirect and directory blocks, the dentry cache and
+	// the running journal batch; file data is copied in and out of the OFT buffers outside it. The bitmap
+	// takes no lock at all.
+	mutable MetaMutex metaLock;
+	mutex tableLock;              // OFTable, freeOft, activeFiles, processes and the OFT reference counts
+
+	// Metadata journal, in JOURNAL_IMAGE while ldisk is a mapped working copy. Whatever one outermost
+	// hold of metaLock changes in the cache and the bitmap is one transaction: the blocks it touched are
+	// copied into the running batch when metaLock is let go. Every JOURNAL_COMMIT_MS a committer thread
+	// seals the batch into one record and appends it with a single write and fdatasync (group commit);
+	// commit() does the same on demand. DISK_IMAGE is only written between transactions, so a record
+	// never holds half of one, and restore() replays the records after the last checkpoint.
+	// A freed block is revoked, so images from older records never land on it once it holds file data.
+	// File data is not logged; a block allocated since the checkpoint is zeroed by replay instead, so a
+	// file never shows what the saved image held there for another file.
+	static const int JOURNAL_COMMIT_MS = 20;
+	static const int64_t JOURNAL_CHECKPOINT_BYTES = 8 << 20;  // log size that triggers a checkpoint
+	static const int JOURNAL_MAGIC = 0x4c4a3335;   // "53JL"
+	static const int JOURNAL_HEADER = 32;   // magic, B, blockCount, unused, checkpoint sequence
+	static const int RECORD_HEADER = 32;    // magic, images, revokes, zeroed, sequence, checksum
+	int journalFd;                          // -1 while there is no journal
+	unordered_set<int> journalTouched;      // blocks changed under the current hold of metaLock
+	atomic<bool>* bitmapBlockUnlogged;      // bitmap block changed since it was last put in the batch
+	atomic<bool> bitmapUnlogged;            // some bitmapBlockUnlogged flag is set
+	atomic<uint64_t>* freedWords;           // blocks freed while journaling, still set in bitmapWords until revoked
+	atomic<bool>* bitmapBlockFreed;         // some word of the bitmap block has freedWords bits
+	atomic<bool> blocksFreed;               // some bitmapBlockFreed flag is set
+	atomic<uint64_t>* allocatedWords;       // blocks allocated while journaling, not in batchZeroes yet
+	atomic<bool>* bitmapBlockAllocated;     // some word of the bitmap block has allocatedWords bits
+	atomic<bool> blocksAllocated;           // some bitmapBlockAllocated flag is set
+	vector<int> batchBlocks;                // running batch: block of each image, -1 once freed
+	vector<char> batchImages;               // B bytes for each entry of batchBlocks
+	unordered_map<int, int> batchSlot;      // block -> entry in batchBlocks
+	vector<int> batchRevokes;               // blocks freed since they were last logged
+	vector<int> batchZeroes;                // blocks allocated in the batch, zeroed by replay before its images
+	unordered_map<int, uint64_t> loggedBlocks;  // block -> last record holding it, since the checkpoint
+	uint64_t journalSeq;                    // last sealed record
+	deque<vector<char> > journalQueue;      // sealed records not written yet
+	mutex journalQueueLock;                 // journalQueue and journalStop
+	mutex journalLock;                      // writes to the log and journalEnd
+	atomic<uint64_t> journalDurable;        // last record known to be on disk
+	int64_t journalEnd;                     // where the next record goes
+	thread journalThread;
+	bool journalStop;
+	condition_variable journalWake;
+
+	// Periodic checkpoint: a thread that calls save_image() every checkpointMs milliseconds, so the time
+	// to persist depends on how many blocks changed rather than on the size of the disk.
+	int checkpointMs;                       // 0 while there is no periodic checkpoint
+	thread checkpointThread;
+	bool checkpointStop;
+	mutex checkpointLock;                   // checkpointStop; never held across save_image()
+	condition_variable checkpointWake;
+	atomic<int> checkpointFailures;         // checkpoints that could not write the image
+
+	// In-core state of every open file, shared by all OFT entries that opened it. Readers of the file
+	// hold its lock shared, writers and flushes hold it exclusively.
+	struct ActiveFile
+	{
+		atomic<int> size;           // File size. Authoritative while the file is open.
+		bool sizeDirty;             // size has not been written to the descriptor yet.
+		int openCount;              // OFT entries using it.
+		atomic<uint64_t> version;   // Bumped whenever an OFT entry writes a block of the file back.
+		RwLock lock;
+	};
+	unordered_map<int, ActiveFile> activeFiles;  // descriptor number -> state, nodes never move
+
+	// Sequential access. Once an OFT entry has loaded READAHEAD_TRIGGER blocks in a row, the blocks
+	// after it are read ahead through the I/O engine into two windows of READAHEAD_BLOCKS blocks:
+	// entering one window starts filling the other. Dirty buffers the entry leaves behind are written
+	// by the engine while the entry moves on. Both only apply once the disk is backed by the image
+	// file; on the in-memory disk a block transfer is a plain copy with nothing to overlap.
+	static const int READAHEAD_BLOCKS = 8;
+	static const int READAHEAD_TRIGGER = 2;
+	static const int WRITE_BEHIND_LIMIT = 64;  // blocks in flight before writers wait
+
+	struct Readahead
+	{
+		char* data;        // READAHEAD_BLOCKS * B bytes
+		int first;         // logical block held in data[0]
+		int count;         // blocks held, 0 if the window is empty
+		uint64_t version;  // file version the blocks were read at
+		IoBatch batch;     // reads still in flight
+	};
+
+	// Blocks written behind and not completed yet, with the buffers holding their data. Reads of such a
+	// block are served from the buffer and writes to it wait, so the engine never reorders two writes.
+	unordered_map<int, char*> writesBehind;
+	atomic<int> writesInFlight;
+	vector<char*> spareBuffers;   // B-byte buffers returned by completed writes
+	mutex writeBehindLock;        // ranks below every other lock
+	condition_variable writeBehindDone;
+
+	// Open File Table(OFT), shared by every process. An entry buffers one block of the file and holds
+	// the position; handles that share an entry (dup, fork) share the position. The table grows on demand
+	// and free entries are kept on a stack, so opening and closing are O(1). Entries are never freed
+	// before release(), so handles can point at them.
+	struct OpenFile
+	{
+		char* buffer;         // B bytes, one block of the file. Kept for reuse while the entry is free.
+		int64_t position;     // Current position in the file.
+		int descriptor;       // Descriptor number of the file.
+		int block;            // Logical block of the file held in the buffer, -1 if none.
+		int refCount;         // Process handles referring to this entry, 0 when it is free.
+		int index;            // Position in OFTable.
+		ActiveFile* active;   // State of the open file.
+		bool dirty;           // The buffer differs from the block on disk.
+		int streak;           // Blocks loaded in order, one after another.
+		int knownSize;        // File size when the entry last looked. Files only grow while open, so
+		                      // fgetc()/fputc() trust positions below it without the ActiveFile lock.
+		Readahead* ahead[2];  // Read-ahead windows, NULL until the entry first reads sequentially.
+		mutex lock;           // Guards everything above except refCount.
+	};
+	vector<OpenFile*> OFTable;
+	vector<int> freeOft;   // Free OFT entries.
+
+	// Per-process handle tables. The handles passed to read/write/lseek/close index the current
+	// process's table, which points at the shared OFT entry. Each table has its own lock, so
+	// threads working in different processes never contend on it.
+	struct Process
+	{
+		vector<OpenFile*> handles;  // handle -> OFT entry, NULL if free
+		vector<int> freeHandles;    // free handles
+		bool alive;
+		mutex lock;
+	};
+	vector<Process*> processes;
+	vector<int> freePids;  // exited processes other than 0, handed out again by create_process() and fork_process()
+	Process* mainProcess;  // process 0
+
+	// The current process belongs to the calling thread. A binding from another file system, or from
+	// before the last OpenFileTable(), carries a stale generation and falls back to process 0.
+	struct ProcessBinding
+	{
+		uint64_t generation;
+		Process* process;
+	};
+	static thread_local ProcessBinding boundProcess;
+	static atomic<uint64_t> nextGeneration;
+	uint64_t processGeneration;
+
+	// Bitmap blocks kept as 64-bit words. Bit (i % 64) of word (i / 64) is set when block i is in use.
+	// The words are authoritative; bitmap blocks that changed are copied back to ldisk on sync().
+	// Blocks are claimed by setting their bits with compare-and-swap, so allocation never blocks.
+	atomic<uint64_t>* bitmapWords;
+	int bitmapWordCount;
+	atomic<bool>* bitmapBlockDirty;  // One flag per bitmap block.
+	int descHint;   // No descriptor below this one is free.
+
+	// Next-fit hints are kept per thread so concurrent allocators work in different words. The first
+	// thread to allocate after the bitmap is (re)loaded starts at word 0, later ones spread over the
+	// bitmap. A hint left from another file system or an older bitmap carries a stale generation.
+	static const int HINT_SPREAD = 16;
+	struct AllocHint
+	{
+		uint64_t generation;
+		int word;  // Word index to resume the next-fit search from.
+	};
+	static thread_local AllocHint threadHint;
+	uint64_t bitmapGeneration;
+	atomic<int> hintThreads;  // threads that took a hint since the bitmap was loaded
+
+	// Blocks claimed in one batch by a large write and handed out, in order, as it maps new blocks
+	struct BlockReserve
+	{
+		vector<int> blocks;
+		size_t next;
+	};
+
+	char* zeroBlock;  // B zero bytes, never written
+
+	// A directory is a file of entries like the root, and its size field counts its entries.
+	// The descriptor number stored in an entry carries DIR_FLAG when the entry is a subdirectory.
+	static const int DIR_FLAG = 0x40000000;
+
+	// Dentry cache. Every directory looked into gets an in-memory index of its entries keyed by name,
+	// so resolving a path costs one hash lookup per component. The directory blocks stay a flat array
+	// of entries; slot s lives in logical block s / entries-per-block. Dropped on format/mount and
+	// filled again on first use.
+	struct DirectoryEntry
+	{
+		int slot;    // position of the entry in its directory
+		int desc;    // descriptor number, without DIR_FLAG
+		bool isDir;
+	};
+	struct DirectoryIndex
+	{
+		unordered_map<string, DirectoryEntry> entries;
+		priority_queue<int, vector<int>, greater<int> > freeSlots;  // empty slots, lowest first
+		int slotCount;                                            // slots in the allocated directory blocks
+	};
+	unordered_map<int, DirectoryIndex> dentryCache;  // directory descriptor -> its index
 
 
 public:
@@ -55,18 +944,47 @@ public:
 	/* Constructor of this File system.
 	*   1. Initialize IO system.
 	*   2. Format it if not done.
+	* Parameter(s):
+	*    block_size: block length in bytes (multiple of 8, at least 64)
+	*    block_count: number of blocks on the disk
+	*    descriptor_count: number of descriptors, including the root directory
+	*    open_files: initial number of open file table entries (the table grows as needed)
+	*    name_length: maximum size of file name in bytes
+	*   An invalid geometry falls back to the defaults.
 	*/
-	FileSystem53();
+	FileSystem53(int block_size = 64, int block_count = MAX_BLOCK_NO, int descriptor_count = MAX_FILE_NO + 1,
+		int open_files = MAX_OPEN_FILE, int name_length = MAX_FILE_NAME_LEN);
 
-	// Open File Table(OFT).
+	// Open File Table(OFT). Closes everything and leaves a single process, process 0.
 	void OpenFileTable();
 
-	// Allocate open file table
+	// Allocate open file table entry, growing the table when none is free
 	int find_oft();
 
 	//Deallocate
 	void deallocate_oft(int index);
 
+	// Reset the per-open fields of an entry, leaving its buffer and read-ahead windows alone
+	void clear_oft(OpenFile& file);
+
+	/* Process handle tables.
+	*    create_process() starts a process with no open files.
+	*    fork_process() starts one whose handles share the current process's OFT entries.
+	*    switch_process() makes 'pid' the process whose handles the calling thread's file operations use.
+	*      Threads start out in process 0.
+	*    exit_process() closes every handle of 'pid'. Its id may be handed out again, so a thread whose
+	*      process exited switches to another before it uses the file system again.
+	* Return:
+	*    The new process id, or 0 for switch_process(); -1 if 'pid' is not a live process.
+	*/
+	int create_process();
+	int fork_process();
+	int switch_process(int pid);
+	int exit_process(int pid);
+
+	// New handle in the current process sharing the OFT entry (and position) of handle 'index', -1 on error
+	int dup(int index);
+
 	/* Format file system.
 	*   1. Initialize the first K blocks with zeros.
 	*   2. Create root directory descriptor for directory file.
@@ -78,13 +996,34 @@ public:
 	void format();
 
 
+	/* Format file system with a new geometry.
+	*   Reallocates the disk and the open file table, then calls format().
+	* Parameter(s):
+	*    see the constructor
+	* Return:
+	*    0 on success
+	*    -1 if the geometry is invalid (the disk is left unchanged)
+	*/
+	int format(int block_size, int block_count, int descriptor_count, int open_files, int name_length);
+
+
+	/* Mount the disk.
+	*   Reads the geometry from the superblock and reloads the bitmap.
+	* Return:
+	*    0 on success
+	*    -1 if the superblock is not valid or its layout is not the one the geometry gives
+	*/
+	int mount();
+
+
 	/* Read descriptor
 	* Parameter(s):
 	*    no: Descriptor number to read
+	*    desc: char[DESCR_SIZE] to copy the descriptor into
 	* Return:
-	*    Return char[4] of descriptor
+	*    Return desc
 	*/
-	char* read_descriptor(int no);
+	char* read_descriptor(int no, char* desc);
 
 
 	/* Clear descriptor
@@ -101,8 +1040,7 @@ public:
 
 	/* Write descriptor
 	*   1. Update descriptor entry
-	*   2. Mark bitmap
-	*   3. Write back to disk
+	*   2. Write back to disk
 	* Parameter(s):
 	*    no: Descriptor number to write
 	*    desc: descriptor to write
@@ -115,54 +1053,135 @@ public:
 	/* Search for an unoccupied descriptor.
 	* If ARRAY[0] is zero, this descriptor is not occupied.
 	* Then it returns descriptor number.
+	* Return value -1 means all descriptors are occupied.
 	*/
 	int find_empty_descriptor();
 
 
-	/* Search for an unoccupied block.
-	*   This returns the first unoccupied block in bitmap field.
-	*   Return value -1 means all blocks are occupied.
+	/* Allocate an unoccupied block.
+	*   1. Take 'goal' if it is free, otherwise find an empty block
+	*   2. Set its bit with an atomic operation; the bitmap block is written back on sync()
 	* Parameter(s):
-	*    none
+	*    goal: preferred block number (keeps a file's blocks contiguous), -1 for none
 	* Return:
 	*    Returns the block number
-	*    -1 if not found
+	*    -1 if the disk is full
+	*/
+	int allocate_block(int goal = -1);
+
+
+	/* Allocate up to 'count' unoccupied blocks at once.
+	*   Scans from the word holding 'goal' (or the next-fit hint) and claims as many free bits of a
+	*   word as it needs with one compare-and-swap, so a run of free blocks comes back in order.
+	* Parameter(s):
+	*    count: number of blocks wanted
+	*    blocks: receives the block numbers, room for 'count'
+	*    goal: block to start looking at, -1 for the next-fit hint
+	* Return:
+	*    Number of blocks allocated, less than count if the disk is full
+	*/
+	int allocate_blocks(int count, int* blocks, int goal = -1);
+
+
+	/* Release a block.
+	*   Clears the bit of the block and writes the changed word back to disk.
+	*   While the journal runs the block is queued instead, without taking metaLock; its bit is cleared
+	*   when the next transaction ends, once older journal images of it are revoked.
+	*   Reserved blocks are never released.
+	* Parameter(s):
+	*    no: block number to free
+	*/
+	void free_block(int no);
+
+
+	// Set or clear the bit of block 'no' and write that word back to disk
+	void mark_block(int no, bool used);
+
+	// Reload the in-memory bitmap words from the bitmap blocks
+	void load_bitmap();
+
+
+	/* Map a logical block of a file to its disk block.
+	*   Walks the direct, single indirect and double indirect block numbers of the descriptor.
+	*   With allocate set, missing blocks (including indirect blocks) are allocated next to
+	*   their neighbours and the descriptor / indirect blocks are written back.
+	* Parameter(s):
+	*    desc_no: descriptor number of the file
+	*    blockNumber: logical block number in the file
+	*    allocate: allocate the block if it is not mapped yet
+	* Return:
+	*    Returns the disk block number
+	*    0 if the block is not allocated
+	*    -1 if blockNumber is past the maximum file size or the disk is full
 	*/
-	int find_empty_block();
+	int map_block(int desc_no, int blockNumber, bool allocate);
 
 
 	/* Get one character.
 	*    Returns the character currently pointed by the internal file position
 	*    indicator of the specified stream. The internal file position indicator
 	*    is then advanced to the next character.
+	*    Inside the block held in the OFT buffer this only bumps the position; the
+	*    next block is loaded when the position crosses a block boundary.
 	* Parameter(s):
-	*    index (descriptor number of the file to be added.)
+	*    index: File index of the open file to read from.
 	* Return:
-	*    On success, the character is returned.
-	*    If a writing error occurs, EOF is returned.
+	*    On success, the character is returned as an unsigned char cast to an int.
+	*    At end of file, or if the file hasn't been open, EOF is returned.
 	*/
-	int fgetc(int index);
+	int fgetc(int index)
+	{
+		OpenFile* file = oft_entry(index);
+		if (file == NULL)
+			return EOF;
+
+		// inside the buffered block and below the size seen last, the character is just picked up
+		lock_guard<mutex> entryGuard(file->lock);
+		if (file->block == (int)(file->position / B) && file->position < file->knownSize)
+			return (unsigned char)file->buffer[file->position++ % B];
+		return fgetc_slow(*file);
+	}
 
 
 	/* Put one character.
 	*    Writes a character to the stream and advances the position indicator.
 	*    The character is written at the position indicated by the internal position
 	*    indicator of the file, which is then automatically advanced by one.
+	*    Inside a block of the file held in the OFT buffer the character goes straight
+	*    into the buffer; anything else takes the path of write().
 	* Parameter(s):
 	*    c: character to write
-	*    index (descriptor number of the file to be added.)
+	*    index: File index of the open file to write to.
 	* Return:
 	*    On success, the character written is returned.
+	*    -1 if the file hasn't been open.
 	*    If a writing error occurs, -2 is returned.
 	*/
-	int fputc(int c, int index);
+	int fputc(int c, int index)
+	{
+		OpenFile* file = oft_entry(index);
+		if (file == NULL)
+			return -1;
+
+		// overwriting inside the buffered block leaves the size alone
+		{
+			lock_guard<mutex> entryGuard(file->lock);
+			if (file->block == (int)(file->position / B) && file->position < file->knownSize)
+			{
+				file->buffer[file->position++ % B] = (char)c;
+				file->dirty = true;
+				return (unsigned char)c;
+			}
+		}
+		return fputc_slow(*file, index, (char)c);
+	}
 
 
 	/* Check for the end of file.
 	* Parameter(s):
-	*    index (descriptor number of the file to be added.)
+	*    index: File index of the open file.
 	* Return:
-	*    Return true if end-of-file reached.
+	*    Return true if end-of-file reached, or if the file hasn't been open.
 	*/
 	bool feof(int index);
 
@@ -195,15 +1214,36 @@ public:
 	*    2. makes/allocates descriptor.
 	*    3. updates directory file.
 	* Parameter(s):
-	*    symbolic_file_name: The name of file to create.
+	*    symbolic_file_name: Path of the file to create, e.g. "docs/a". Every directory on the way must exist.
 	* Return:
 	*    Return 0 for successful creation.
-	*    Return -1 for error (no space in disk)
+	*    Return -1 for error (no space in disk, or name longer than nameLength)
 	*    Return -2 for error (for duplication)
 	*/
 	int create(string symbolic_file_name);
 
 
+	/* Directory creation function:
+	*    Creates an empty directory. It takes a descriptor like a file.
+	* Parameter(s):
+	*    path: Path of the directory to create.
+	* Return:
+	*    Same as create().
+	*/
+	int mkdir(string path);
+
+
+	/* Directory removal function:
+	* Parameter(s):
+	*    path: Path of the directory to remove.
+	* Return:
+	*    Return 0 with success
+	*    Return -1 if there is no such directory
+	*    Return -2 if the directory is not empty
+	*/
+	int rmdir(string path);
+
+
 	/* Open file with descriptor number function:
 	* Parameter(s):
 	*    desc_no: descriptor number
@@ -216,7 +1256,7 @@ public:
 
 	/* Open file with file name function:
 	* Parameter(s):
-	*    symbolic_file_name: The name of file to open.
+	*    symbolic_file_name: Path of the file to open. Directories cannot be opened.
 	* Return:
 	*    index: An integer number, which is a index number of open file table.
 	*    Return -1 or -2 if it cannot be open.
@@ -258,10 +1298,26 @@ public:
 	3.4 If count > mem_area size, only size of mem_area should be read.
 	3.5 Returns actual number of bytes read from file.
 	3.6 Update current position so that next read() can be done from the first byte haven't-been-read.
+	Whole blocks are copied straight from ldisk into mem_area; only partial blocks go through the OFT buffer.
 	*/
 	int read(int index, char* mem_area, int count);
 
 
+	/* Vectored read function:
+	*    Fills vectors[0], vectors[1], ... in order from the current position, like
+	*    consecutive read() calls but in one pass.
+	* Parameter(s):
+	*    index: File index which indicates the file to be read.
+	*    vectors: destination buffers
+	*    vector_count: number of entries in vectors
+	* Return:
+	*    Total number of bytes read into all buffers.
+	*    -1 value for error case "File hasn't been open"
+	*    -2 value for error case "End-of-file"
+	*/
+	int readv(int index, const IoVector* vectors, int vector_count);
+
+
 	/* File Write function:
 	*    This writes 'count' number of 'value'(s) to the file indicated by index.
 	*    Writing should start from the point pointed by current position of the file.
@@ -271,13 +1327,34 @@ public:
 	*    value: a character to be written.
 	*    count: Number of repetition.
 	* Return:
-	*    >0 for successful write
+	*    Number of bytes written (less than count if the file or the disk is full)
 	*    -1 value for error case "File hasn't been open"
-	*    -2 for error case "Maximum file size reached" (not implemented.)
+	*    -2 for error case "Maximum file size reached"
 	*/
 	int write(int index, char value, int count);
 
 
+	/* Bulk write function:
+	*    Writes n bytes from data[] at the current position of the file indicated by index.
+	*    Data is copied into the OFT buffer a block at a time; new blocks are only
+	*    allocated when the position crosses into them.
+	* Parameter(s):
+	*    index: File index which indicates the file to be written.
+	*    data: bytes to write
+	*    n: number of bytes
+	* Return:
+	*    Number of bytes written (less than n if the file or the disk is full)
+	*    -1 value for error case "File hasn't been open"
+	*    -2 for error case "Maximum file size reached"
+	*/
+	int write(int index, const char* data, size_t n);
+
+#if __cplusplus >= 202002L
+	// Bulk write of a span, see write(int, const char*, size_t)
+	int write(int index, span<const char> data) { return write(index, data.data(), data.size()); }
+#endif
+
+
 	/* Setting new read/write position function:
 	* Parameter(s):
 	*    index: File index which indicates the file to be read.
@@ -298,21 +1375,33 @@ public:
 	void close(int index);
 
 
+	/* Flush file function:
+	*    Writes the OFT buffer back to ldisk and persists the file size in the descriptor
+	*    if it changed since the file was opened or last flushed.
+	* Parameter(s):
+	*    index: The index of open file table
+	* Return:
+	*    0 on success
+	*    -1 value for error case "File hasn't been open"
+	*/
+	int flush(int index);
+
+
 	/* Delete file function:
 	*    Delete a file
 	* Parameter(s):
-	*    symbolic_file_name: a file name to be deleted.
+	*    symbolic_file_name: path of the file to be deleted.
 	* Return:
 	*    Return 0 with success
-	*    Return -1 with error (ie. No such file).
+	*    Return -1 with error (ie. No such file, it is a directory, or it is open).
 	*/
 	int deleteFile(string fileName);
 
 
 	/* Directory listing function:
-	*    List the name and size of files in the directory. (We have only one directory in this project.)
+	*    List the name and size of files in the root directory. Subdirectories are listed with a trailing '/'.
 	*    Example of format:
-	*       abc 66 bytes, xyz 22 bytes
+	*       abc 66 bytes, xyz 22 bytes, docs/
 	* Parameter(s):
 	*    None
 	* Return:
@@ -320,26 +1409,149 @@ public:
 	*/
 	void directory();
 
+	// List the directory named by 'path' the same way. Returns -1 if there is no such directory.
+	int directory(string path);
+
+	// What list() fills in besides the name and descriptor of each entry
+	enum ListAttributes { LIST_NAMES = 0, LIST_SIZES = 1, LIST_BLOCKS = 2 };
+
+	// One entry of a directory, as returned by list()
+	struct DirEntry
+	{
+		string name;
+		int descriptor;    // descriptor number, without DIR_FLAG
+		bool directory;    // the entry is a subdirectory
+		int size;          // bytes, or entries of a subdirectory; -1 without LIST_SIZES
+		int blocks;        // data and indirect blocks the entry holds, -1 without LIST_BLOCKS
+	};
+
+	/* Directory listing into a caller buffer:
+	*    Reads the directory blocks once, without formatting anything, and then looks up the
+	*    attributes that were asked for. Reusing one vector between calls keeps its storage.
+	* Parameter(s):
+	*    path: directory to list, "" for the root
+	*    entries: receives the entries in slot order; cleared first
+	*    attributes: LIST_NAMES, or LIST_SIZES and/or LIST_BLOCKS
+	* Return:
+	*    Number of entries
+	*    -1 if there is no such directory
+	*/
+	int list(string path, vector<DirEntry>& entries, int attributes = LIST_NAMES);
+
 	/*------------------------------------------------------------------
 	Disk management functions.
 	These functions are not really a part of file system.
 	They are provided for convenience in this emulated file system.
 	------------------------------------------------------------------
 	Restores the saved disk image in a file to the array.
+	Where mmap is available ldisk becomes a mapped working copy of the image: the kernel copies
+	the file, sharing extents where the file system can, and blocks are paged in on first use,
+	so the image may be larger than memory. Changes made since the last save are discarded;
+	metadata changes left in the journal by a run that crashed before saving are replayed.
 	*/
 	void restore();
 
 	// Saves the array to a file as a disk image.
+	// Once ldisk is a mapped working copy only the dirty blocks are written, and the journal is emptied.
 	void save();
 
 	// Disk dump, from block 'start' to 'start+size-1'.
 	void diskdump(int start, int size);
 
+	// 64-bit FNV-1a hash of the whole disk image, taken over native-endian 8-byte words.
+	// The cache is synced first.
+	uint64_t checksum();
+
 	// Reads block from ldisk and copies it to pointer p
 	void read_block(int i,  char *p);
 
 	// Writes block from p and copies it to ldisk at index i
-	void write_block(int i,  char *p);
+	void write_block(int i,  const char *p);
+
+	// Write the dirty cache frames and bitmap blocks back to ldisk
+	void sync();
+
+
+	/* Asynchronous block I/O.
+	*   The request goes to the I/O engine: io_uring on the image file once the disk has been saved
+	*   or restored, a thread pool otherwise. A block held in the buffer cache is served from the
+	*   cache and completes at once.
+	* Parameter(s):
+	*    i: block number
+	*    p: B bytes, valid until the request completes. Block i must not be used meanwhile.
+	*    done: called with B on success or -1 on error, possibly from another thread.
+	*      It must not start more asynchronous I/O.
+	* Return:
+	*    The future forms yield the value 'done' would get.
+	*/
+	void read_block_async(int i, char* p, IoCallback done);
+	void write_block_async(int i, const char* p, IoCallback done);
+	future<int> read_block_async(int i, char* p);
+	future<int> write_block_async(int i, const char* p);
+
+	// Name of the I/O engine: "io_uring" or "thread pool"
+	const char* io_backend()
+	{
+		lock_guard<mutex> guard(ioLock);
+		return io()->name();
+	}
+
+	/* Make every metadata change so far durable in the journal.
+	*   Threads committing at the same time share one log write.
+	* Return:
+	*    0 on success, -1 if there is no journal because the disk is not backed by the image file yet
+	*/
+	int commit();
+
+	/* Save the disk image in the background every 'ms' milliseconds.
+	*   Like save(), each checkpoint writes only the blocks changed since the last one.
+	* Parameter(s):
+	*    ms: interval between checkpoints, 0 to stop them
+	* Return:
+	*    0 on success, -1 if ms is negative
+	*/
+	int checkpoint_every(int ms);
+
+	// Number of background checkpoints that could not write the disk image
+	int checkpoint_failures() { return checkpointFailures.load(); }
+
+	// Sync and resize the buffer cache to 'frames' frames (at least 1)
+	void set_cache_size(int frames);
+
+	// API operations timed by stats()
+	enum StatOp { STAT_CREATE, STAT_OPEN, STAT_READ, STAT_WRITE, STAT_LSEEK, STAT_CLOSE, STAT_DELETE, STAT_OPS };
+
+	// Name of a StatOp, as the driver prints it
+	static const char* stat_op_name(int op);
+
+	/* Counters of the file system, kept until reset_stats().
+	*   Metadata blocks are the ones going through the buffer cache, plus any block below dataStart read or
+	*   written directly; every other read_block()/write_block(), asynchronous or write-behind transfer is data.
+	*   A block is counted when it moves between ldisk and the cache or the caller, not when the cache serves it.
+	*   fgetc() is not timed; fputc() counts as a write only where it falls back to write() at a block boundary.
+	*   calls and nanoseconds stay zero unless the file system is built with FS53_STATS; the other counters
+	*   are always kept, so the cache can be sized from them in any build.
+	*/
+	struct Stats
+	{
+		uint64_t calls[STAT_OPS];        // API calls of each operation
+		uint64_t nanoseconds[STAT_OPS];  // time spent in them
+		uint64_t metaReads;              // metadata blocks loaded from ldisk
+		uint64_t metaWrites;             // metadata blocks written to ldisk
+		uint64_t dataReads;              // data blocks read from ldisk
+		uint64_t dataWrites;             // data blocks written to ldisk
+		uint64_t allocatorScans;         // bitmap searches for free blocks
+		uint64_t allocatorWords;         // bitmap words those searches looked at
+		uint64_t oftReloads;             // times an OFT buffer moved to another block of its file
+		uint64_t cacheHits;              // block views served from the buffer cache
+		uint64_t cacheMisses;            // block views that loaded the block from ldisk
+		uint64_t cacheWritebacks;        // blocks written back to ldisk by eviction or sync()
+	};
+	Stats stats() const;
+	void reset_stats();
+
+	// True if block i changed since the image was last saved or restored
+	bool block_dirty(int i) const { return blockDirty[i]; }
 
 	// Prints out the ldisk
 	void print();
@@ -347,1026 +1559,4321 @@ public:
 	// Return current position in OFTable
 	int getCurrentPosition(int index);
 
+	// Number of handles open in the current process
+	int open_handles();
+
 	~FileSystem53();
-};
 
-//done
-FileSystem53::FileSystem53()
-{
-	ldisk = new char*[l];
-	for (int i = 0; i < l; i++)
-	{
-		ldisk[i] = new char[l];
+private:
 
-		if (i == 0)
-		{
-			for (int j = 0; j < l; j++)
-				ldisk[i][j] = '0';
-		}
-		else if (i < l)
-		{
-			for (int j = 0; j < l; j++)
-				ldisk[i][j] = '\0';
-		}
+	// Check a geometry before formatting with it
+	static bool valid_geometry(int block_size, int block_count, int descriptor_count, int open_files, int name_length);
 
-		OpenFileTable();
-	}
-}
+	// Set the geometry members and (re)allocate ldisk, the bitmap words and the open file table.
+	// A mapped image passed in with its file descriptor is adopted as ldisk instead.
+	void set_geometry(int block_size, int block_count, int descriptor_count, int open_files, int name_length,
+		char* image = NULL, int image_fd = -1);
 
-//done
-void FileSystem53::read_block(int i,  char *p)
-{
-	char *q = ldisk[i];
-	for (int i = 0; i < l; i++)
-	{
-			p[i] = q[i];
-	}
-}
+#if defined(FS53_MMAP_IMAGE)
+	// Move the in-memory disk into a mapped working copy; the next write_dirty() writes DISK_IMAGE whole
+	bool attach_image();
+#endif
 
-//done
-void FileSystem53::write_block(int i,  char *p)
-{
-	for (int j = 0; j < l; j++)
-	{
-			ldisk[i][j] = p[j];
-	}
-}
+	// Free ldisk, the bitmap words and the open file table
+	void release();
 
-//done
-void FileSystem53::save()
-{
-	ofstream txtFile("savedFile.txt");
-	for (int i = 0; i < l; i++)
-	{
-		for (int j = 0; j < l; j++)
-		{
-			if (ldisk[i][j] == '\n')
-			{
-				txtFile.put(200);
-			}
-			else if (ldisk[i][j] == '\r')
-			{
-				txtFile.put(201);
-			}
-			else
-				txtFile.put(ldisk[i][j]);
-		}
-	}
-	txtFile.close();
-}
+	// The I/O engine, started if there is none. The caller holds ioLock.
+	AsyncIo* io();
 
-//done
-void FileSystem53::restore()
-{
-	ifstream txtFile("savedFile.txt");
-	string str;
-	string file_contents;
-	int counter = 0;
-	if (txtFile.is_open())
-	{
-		while (getline(txtFile, str))
-		{
-			file_contents += str;
-		}
+	// Hand one block transfer to the I/O engine. 'done' must not submit further requests.
+	void submit_io(bool write, char* data, int i, IoCallback done);
+
+	// Wait until no thread is submitting, finish the outstanding requests and stop the I/O engine
+	void stop_io();
+
+	// Read blocks[k] into buffers[k] for every k at once and wait for all of them. Returns -1 on error.
+	int read_blocks(const vector<int>& blocks, const vector<char*>& buffers);
+
+	// Handle table of the calling thread's current process
+	Process* current_process();
 
-		for (int i = 0; i < 64; i++)
+	// OFT entry behind handle 'index' of the current process, NULL if the handle is not open
+	OpenFile* oft_entry(int index);
+
+	// Drop one reference to an OFT entry, flushing and freeing it with the last one
+	void release_oft(OpenFile* file);
+
+	// Id of a live process with no handles, reusing an exited one's slot. The caller holds tableLock.
+	int new_process();
+
+	// Remember that block i differs from the disk image. The caller holds metaLock.
+	void mark_dirty(int i)
+	{
+		if (!blockDirty[i])
 		{
-			for (int j = 0; j < 64; j++)
-			{
-				if (file_contents[counter] == (char)200)
-				{
-					ldisk[i][j] = '\n';
-				}
-				else if ((int)file_contents[counter] == (char)201)
-					ldisk[i][j] = '\r';
-				else
-				{
-					ldisk[i][j] = file_contents[counter];
-				}
-				counter++;
-			}
+			blockDirty[i] = true;
+			dirtyBlocks.push_back(i);
 		}
 	}
-	else
-		cout << "\nUnable to open file.";
-}
 
-//done
-FileSystem53::~FileSystem53()
-{
-	for (int i = 0; i < l; i++)
+	// Forget which blocks changed, once ldisk and the disk image agree again
+	void clear_dirty()
 	{
-		delete ldisk[i];
+		for (size_t k = 0; k < dirtyBlocks.size(); k++)
+			blockDirty[dirtyBlocks[k]] = false;
+		dirtyBlocks.clear();
 	}
 
-	delete ldisk;
-}
+	// Write the dirty blocks to the disk image, one request per run of neighbouring blocks, and clear them
+	bool write_dirty();
 
-//done
-void FileSystem53::print()
-{
-	char* fileDescriptor = new char[l];
-	read_block(1, fileDescriptor);
-	for (int i = 0; i < l; i++)
-	{
-		if (i == 0)
-		{
-			cout << "Bytemap: ";
-		}
-		else if (i < 7)
-		{
-			cout << "File Descriptors: ";
-		}
-		else
-			cout << "Block " << i << ": ";
+	// save() without the message: false if the image could not be written
+	bool save_image();
 
-		for (int j = 0; j < l; j++)
-		{
-			cout << ldisk[i][j];
-		}
+	// Start the checkpoint thread if checkpointMs asks for one
+	void start_checkpointer();
 
-		cout << endl;
+	// Stop the checkpoint thread, leaving checkpointMs as it is
+	void stop_checkpointer();
+
+	// Checkpoint thread: save_image() every checkpointMs until stopped, counting the failures
+	void checkpointer();
+
+	// Counters behind stats(), bumped with relaxed atomics from any thread. The per-operation timers
+	// are compiled out without FS53_STATS, which leaves OpTimer empty; the block and cache counters stay.
+	enum StatCounter
+	{
+		COUNT_META_READS, COUNT_META_WRITES, COUNT_DATA_READS, COUNT_DATA_WRITES, COUNT_ALLOC_SCANS,
+		COUNT_ALLOC_WORDS, COUNT_OFT_RELOADS, COUNT_CACHE_HITS, COUNT_CACHE_MISSES, COUNT_CACHE_WRITEBACKS,
+		COUNT_KINDS
+	};
+	atomic<uint64_t> statCounts[COUNT_KINDS];
+#if defined(FS53_STATS)
+	atomic<uint64_t> opCalls[STAT_OPS];
+	atomic<uint64_t> opNanoseconds[STAT_OPS];
+#endif
+
+	// Add n to a stats counter
+	void count_stat(StatCounter counter, uint64_t n = 1)
+	{
+		statCounts[counter].fetch_add(n, memory_order_relaxed);
 	}
 
-	cout << endl << "OFTABLE" << endl;
-	for (int k = 0; k < 3; k++)
+	// Counts one API call and adds the time until the end of the scope to the stats
+	class OpTimer
 	{
-			cout << "Contents of OFTable " << endl;
-		for (int j = 0; j < 66; j++)
+	public:
+#if defined(FS53_STATS)
+		OpTimer(FileSystem53* fs, StatOp op) : owner(fs), kind(op), start(chrono::steady_clock::now()) {}
+		~OpTimer()
 		{
-			cout << OFTable[k][j];
-			if (j == 64)
-				cout << endl << " Current Position: " << (int)OFTable[k][j] << endl;
-			if (j == 65)
-				cout << endl << " File length: " << (int)fileDescriptor[OFTable[k][j]] << endl;
+			chrono::steady_clock::duration spent = chrono::steady_clock::now() - start;
+			owner->opCalls[kind].fetch_add(1, memory_order_relaxed);
+			owner->opNanoseconds[kind].fetch_add((uint64_t)chrono::duration_cast<chrono::nanoseconds>(spent).count(),
+				memory_order_relaxed);
 		}
-		cout << endl;
-	}
 
-	delete fileDescriptor;
-}
+	private:
+		FileSystem53* owner;
+		StatOp kind;
+		chrono::steady_clock::time_point start;
+#else
+		OpTimer(FileSystem53*, StatOp) {}
+#endif
+	};
 
-//done
-int FileSystem53::create(string symbolic_file_name)
-{
-	 char* bytemap = new  char[l];
-	 char* fileDescriptor = new  char[l];
-	 char* directoryFile = new  char[l];
+	// Block i on the emulated device, bypassing the cache
+	char* device_block(int i) { return ldisk + (size_t)i * B; }
 
-	char tempChar;
-	int asciiNum = '\0';
-	int directoryIndexFound;
-	char fileDescriptorIndex;
+	// Frame holding block i, loading it and evicting another block on a miss
+	int cache_frame(int i);
 
-	bool flag = false;
-	bool found = false;
+	// Read-only view of block i, held in the buffer cache. The caller holds metaLock; the view is
+	// valid until the next block() or block_for_write() call, which may evict it.
+	const char* block(int i) { return cacheData + (size_t)cache_frame(i) * B; }
 
-	read_block(0, bytemap);
-	read_block(1, fileDescriptor);
+	// Writable view of block i, held in the buffer cache. The block is marked dirty; the caller holds metaLock.
+	char* block_for_write(int i);
 
-	// check and find a free file descriptor
-	int tempCount = 1;
-	while (tempCount < l && !flag)
-	{
-		tempCount += 4;
-		if (fileDescriptor[tempCount] == '\0')
-		{
-			fileDescriptorIndex = tempCount;
-			flag = true;
-		}
-	}
+	// (Re)allocate 'frames' empty cache frames, dropping any cached blocks
+	void allocate_cache(int frames);
 
-	// out of space
-	if (!flag)
-	{
-		return -1;
-	}
+	// Drop every cached block without writing it back
+	void invalidate_cache();
 
-	// check the directory's file descriptor to see if the file already exists
-	for (int i = 1; i < 4; i++)
-	{
-		// the directory's file descriptor has an allocated block
-		if (fileDescriptor[i] != '\0')
-		{
-			asciiNum = fileDescriptor[i];
-			read_block(asciiNum, directoryFile);
+	// Block and byte offset of descriptor 'no' in the descriptor table
+	int descriptor_block(int no) { return descStart + no / (B / DESCR_SIZE); }
+	int descriptor_offset(int no) { return (no % (B / DESCR_SIZE)) * DESCR_SIZE; }
 
-			// loop through every 10-byte filenames within the directory to find the file
-			int count = 0;
-				for (int j = 0; j < 55; j = count * 11)
-				{
-					count++;
-					// found a free spot in directory file
-					if (directoryFile[j] == '\0' && !found)
-					{
-						directoryIndexFound = j;
-						found = true;
-					}
-					else // search through to find dupes
-					{
-						int k = 0;
-						bool temp = true;
-						while (k < symbolic_file_name.length() && temp)
-						{
-							temp = (symbolic_file_name[k] == directoryFile[j]);
-							k++;
-							j++;
-						}
+	// Number of directory entries in one block
+	int entries_per_block() { return B / dirEntrySize; }
 
-						// file was found in the directory file
-						if (temp)
-						{
-							return -2;
-						}
+	// Index of directory 'dir', read from its blocks on first use
+	DirectoryIndex& directory_index(int dir);
 
-						temp = true;
-					}
-				}
-		}
-		else if (!found) // the directory's file descriptor has an empty block
-		{
-			// search the bytemap to find an open, empty block
-			for (int j = 7; j < l; j++)
-			{
-				// if found, change the bytemap to 1
-				if (bytemap[j] == '0')
-				{
-					read_block(j, directoryFile);
-					bytemap[j] = '1';
-					found = true;
+	// Entry 'name' of directory 'dir', NULL if there is none
+	const DirectoryEntry* find_entry(int dir, const string& name);
 
-					// change the fileDescriptor for directory file
-					asciiNum = j;
-					tempChar = j;
-					fileDescriptor[i] = tempChar;
+	// Split 'path' into the directory holding its last component and that component. Components are
+	// separated by '/' and taken from the root. Returns -1 if a directory on the way does not exist.
+	int resolve_parent(const string& path, int& parent, string& leaf);
 
-					directoryIndexFound = 0;
-					j = l;
-				}
-			}
-		}
-	}
+	// Descriptor number of the directory named by 'path', -1 if there is no such directory
+	int resolve_directory(const string& path);
 
-	//add the file name + index to the directory
-	int counter = 0;
-	for (int n = directoryIndexFound; n < directoryIndexFound + symbolic_file_name.length(); n++)
-	{
-		directoryFile[n] = symbolic_file_name[counter];
-		counter++;
-	}
+	// Add an entry for descriptor 'desc' to directory 'dir'. Returns -1 if the directory cannot grow.
+	int add_entry(int dir, const string& name, int desc, bool isDir);
 
-	//update fileDescriptor
-	for (int i = 7; i < l; i++)
-	{
-		if (bytemap[i] == '0')
-		{
-			bytemap[i] = '1';
+	// Clear entry 'name' of directory 'dir'
+	void remove_entry(int dir, const string& name);
 
-			fileDescriptor[tempCount] = i;
-			i = l;
-		}
-	}
+	// Create an empty file or directory at 'path'. Same return values as create().
+	int create_node(const string& path, bool isDir);
 
-	directoryFile[directoryIndexFound + 10] = fileDescriptorIndex - 1;
+	// Disk block and byte offset of slot 'slot' of directory 'dir'
+	int entry_block(int dir, int slot) { return map_block(dir, slot / entries_per_block(), false); }
+	int entry_offset(int slot) { return (slot % entries_per_block()) * dirEntrySize; }
 
-	int directoryFileNum = fileDescriptor[0];
-	directoryFileNum++;
-	fileDescriptor[0] = directoryFileNum;
+	// Write an OFT entry's buffer and its file's size back to disk.
+	// The caller holds the entry lock and the file's lock exclusively.
+	void flush_oft(OpenFile& file);
 
-	write_block(1, fileDescriptor);
-	write_block(asciiNum, directoryFile);
-	write_block(0, bytemap);
+	// Make an OFT entry hold logical block 'blockNumber' of its file, writing back the old one.
+	// With overwrite set the caller replaces the whole block, so its old contents are not read.
+	void load_oft_block(OpenFile& file, int blockNumber, bool overwrite = false);
 
-	delete bytemap;
-	delete fileDescriptor;
-	delete directoryFile;
+	// Write an OFT entry's buffer back if it is dirty. With 'behind' set and the disk backed by the image file,
+	// the buffer goes to the I/O engine and the entry carries on with a fresh one.
+	void write_back(OpenFile& file, bool behind);
 
-	return 0;
-}
+	// Load logical block 'blockNumber' of an entry's file into 'dst', from a read-ahead window if one holds it
+	void fetch_block(OpenFile& file, int blockNumber, char* dst);
 
-//done
-int FileSystem53::deleteFile(string symbolic_file_name)
-{
-	char* bytemap = new char[l];
-	char* fileDescriptors = new char[l];
-	char* directoryFile = new char[l];
+	// Copy logical block 'blockNumber' out of the entry's read-ahead windows. False if they do not hold it.
+	bool take_readahead(OpenFile& file, int blockNumber, char* dst);
 
-	bool found = true;
-	char tempChar;
-	int asciiNum;
-	int indexOfDirectory;
-	int indexOfFileDescriptor;
-	int indexOfByteMap;
+	// Start reading blocks from 'firstBlock' on into read-ahead window 'w' of an entry
+	void start_readahead(OpenFile& file, int w, int firstBlock);
 
-	// get bytemap
-	read_block(0, bytemap);
+	// Wait for an entry's read-ahead and empty its windows
+	void drop_readahead(OpenFile& file);
 
-	// get file descriptors.
-	read_block(1, fileDescriptors);
+	// Hand block 'blockNo' to the I/O engine to write from 'data', which then belongs to the write.
+	// Returns a free buffer to use in place of data, NULL if the block is cached and nothing was written.
+	char* write_behind(int blockNo, char* data);
 
-	// get the first filedescriptor  ->  the directory file , and check its three datablocks for the filename
-	for (int i = 1; i < 4; i++)
-	{
-		// find and get directory block
-		indexOfDirectory = fileDescriptors[i];
-		read_block(indexOfDirectory, directoryFile);
+	// Wait until block i has no write behind in flight. The caller may hold metaLock.
+	void wait_write_behind(int i);
 
-		int count = 0;
-		for (int j = 0; j < 55; j = count * 11)
-		{
-			found = true;
-			count++;
-			int counter = 0;
-			int start = j;
-			int end;
-			while (counter < symbolic_file_name.length() && found)
-			{
-				found = (directoryFile[j] == symbolic_file_name[counter]);
+	// Copy the data of a write behind to block i into p. False if there is none.
+	bool read_write_behind(int i, char* p);
 
-				counter++;
-				j++;
-			}
+	// Wait for every write behind
+	void drain_write_behind();
 
-			// found
-			if (found)
-			{
-				end = (count * 11) - 1;
-				indexOfFileDescriptor = directoryFile[end];
-				// delete directory file
-				while (start <= end)
-				{
-					directoryFile[start] = '\0';
+	// Block until every request of 'batch' has completed
+	static void wait_batch(IoBatch& batch);
 
-					start++;
-				}
-				// loop through file descriptor and delete blocks/bytemap
-				int temp = 0;
+	// End of the outermost hold of metaLock: move the blocks the transaction changed into the batch
+	void end_transaction();
 
-				while (fileDescriptors[indexOfFileDescriptor] != '\0' && temp < 3)
-				{
-					indexOfByteMap = fileDescriptors[indexOfFileDescriptor + 1];
-					// delete file descriptor
-					fileDescriptors[indexOfFileDescriptor] = '\0';
+	// Copy the current contents of block i into the running batch
+	void journal_capture(int i);
 
-					// delete bytemap index
-					bytemap[indexOfByteMap] = '0';
+	// Turn the running batch into a record queued for the log. Returns the sequence of the last record.
+	uint64_t journal_seal();
 
-					char* p = new char[l];
-					for (int k = 0; k < l; k++)
-					{
-						p[k] = '\0';
-					}
+	// Append the queued records to the log and wait until they are on disk, unless record 'seq' already is
+	bool journal_write(uint64_t seq);
 
-					// delete and update file block
-					write_block(indexOfByteMap, p);
+	// Block i was freed: drop it from the batch and revoke older images of it
+	void journal_forget(int i);
 
-					delete p;
+	// Revoke the blocks free_block() queued and clear their bits. The caller holds metaLock.
+	void release_freed_blocks();
 
-					indexOfFileDescriptor++;
-					temp++;
-				}
+	// Copy bitmap block 'b' out of the bitmap words into p
+	void copy_bitmap_block(int b, char* p);
 
-				// update bytemap
-				write_block(0, bytemap);
+#if defined(FS53_MMAP_IMAGE)
+	// Start an empty journal for the disk image and its committer thread
+	void start_journal();
 
-				// update directory file descriptor's size
-				int directoryFileNum = fileDescriptors[0];
-				directoryFileNum--;
-				fileDescriptors[0] = directoryFileNum;
+	// Stop the committer thread, empty the log and close it. Only a run that crashed leaves records
+	// behind for restore() to replay; a clean stop throws away what was not saved, like the working copy.
+	void stop_journal();
 
-				// update file descriptors
-				write_block(1, fileDescriptors);
+	// Committer thread: commit every JOURNAL_COMMIT_MS and checkpoint once the log grows too large
+	void journal_committer();
 
-				// update directory file
-				write_block(indexOfDirectory, directoryFile);
+	// Write everything back to ldisk, write the dirty blocks to DISK_IMAGE and empty the log
+	void journal_checkpoint();
 
-				delete bytemap;
-				delete fileDescriptors;
-				delete directoryFile;
+	// Empty the log once the image holds every record in it
+	void journal_reset();
 
-				return 0;
-			}
+	// Apply the records of JOURNAL_IMAGE past its checkpoint to ldisk
+	void journal_replay();
+#endif
+
+	// Copy n bytes of data (or n copies of value when data is NULL) into the file at the current position
+	int write_chunks(int index, const char* data, char value, size_t n);
+
+	// Copy up to n bytes from the current position to mem_area, advancing the position.
+	// The caller holds the entry lock and the file's lock.
+	int read_chunks(OpenFile& file, char* mem_area, int n);
+
+	// fgetc() past the buffered block or the size seen last. The caller holds the entry lock.
+	int fgetc_slow(OpenFile& file);
+
+	// fputc() anywhere but over a character of the buffered block
+	int fputc_slow(OpenFile& file, int index, char value);
+
+	// Size of the file with descriptor 'desc_no', taking unflushed sizes of open files into account
+	int file_size(int desc_no);
+
+	// Read the block number at 'offset' in 'container', allocating it when asked; 'changed' is set if it was
+	int map_slot(char* container, int offset, bool allocate, bool indirect, int goal, bool& changed, BlockReserve* reserve);
+
+	// map_block() taking newly mapped blocks from 'reserve' while it lasts
+	int map_block(int desc_no, int blockNumber, bool allocate, BlockReserve* reserve);
+
+	// Next-fit hint of the calling thread
+	int& alloc_hint();
+
+	// Flag the bitmap block holding word 'word' for the next sync() and the journal
+	void bitmap_word_changed(int word)
+	{
+		int b = word * (int)sizeof(uint64_t) / B;
+		bitmapBlockDirty[b].store(true);
+		if (journalFd >= 0)
+		{
+			bitmapBlockUnlogged[b].store(true);
+			bitmapUnlogged.store(true);
+		}
+	}
+
+	// Note the blocks 'bits' of word 'word' as allocated, for the journal to have replay zero them
+	void bits_allocated(int word, uint64_t bits)
+	{
+		if (journalFd >= 0)
+		{
+			allocatedWords[word].fetch_or(bits);
+			bitmapBlockAllocated[word * (int)sizeof(uint64_t) / B].store(true);
+			blocksAllocated.store(true);
 		}
 	}
 
-	delete bytemap;
-	delete fileDescriptors;
-	delete directoryFile;
+	// Call visit() with every data and indirect block of a descriptor, each indirect block after its pointers
+	void walk_file_blocks(const char* desc, const function<void(int)>& visit);
 
-	if (!found)
-		return -1;
-}
+	// Free every data and indirect block of a descriptor
+	void free_file_blocks(char* desc);
+
+	// Number of data and indirect blocks a descriptor holds
+	int count_file_blocks(const char* desc);
+};
+
+thread_local FileSystem53::ProcessBinding FileSystem53::boundProcess = { 0, NULL };
+atomic<uint64_t> FileSystem53::nextGeneration(1);
+thread_local FileSystem53::AllocHint FileSystem53::threadHint = { 0, 0 };
 
 //done
-void FileSystem53::OpenFileTable()
+FileSystem53::FileSystem53(int block_size, int block_count, int descriptor_count, int open_files, int name_length)
+	: metaLock(this)
 {
-
-	oftAllocation = new int[3];
-	//initiaize the arrays simulating the table
-	// 64 is the current position, 65 is the file descriptor index
-	for (int i = 0; i< 3; i++)
-	for (int j = 0; j < (l + 2); j++)
+	ldisk = NULL;
+	imageFd = -1;
+	ioEngine = NULL;
+	ioUsers = 0;
+	writesInFlight = 0;
+	blockDirty = NULL;
+	imageCurrent = false;
+	checkpointMs = 0;
+	checkpointStop = false;
+	checkpointFailures = 0;
+	desc_table = NULL;
+	mainProcess = NULL;
+	bitmapWords = NULL;
+	bitmapBlockDirty = NULL;
+	bitmapBlockUnlogged = NULL;
+	bitmapUnlogged = false;
+	freedWords = NULL;
+	bitmapBlockFreed = NULL;
+	blocksFreed = false;
+	allocatedWords = NULL;
+	bitmapBlockAllocated = NULL;
+	blocksAllocated = false;
+	journalFd = -1;
+	journalSeq = 0;
+	journalDurable = 0;
+	journalEnd = 0;
+	journalStop = false;
+	zeroBlock = NULL;
+	cacheFrames = CACHE_FRAMES;
+	cacheData = NULL;
+	cacheBlock = NULL;
+	cacheFrameDirty = NULL;
+	cacheReferenced = NULL;
+	reset_stats();
+
+	if (!valid_geometry(block_size, block_count, descriptor_count, open_files, name_length))
 	{
-		OFTable[i][j] = 0;
+		block_size = 64;
+		block_count = MAX_BLOCK_NO;
+		descriptor_count = MAX_FILE_NO + 1;
+		open_files = MAX_OPEN_FILE;
+		name_length = MAX_FILE_NAME_LEN;
 	}
 
-	// oft not in use = 0
-	for (int j = 0; j < 3; j++)
-		oftAllocation[j] = 0;
+	set_geometry(block_size, block_count, descriptor_count, open_files, name_length);
+	format();
 }
 
 //done
-int FileSystem53::open(string symbolic_file_name)
+bool FileSystem53::valid_geometry(int block_size, int block_count, int descriptor_count, int open_files, int name_length)
 {
-	int fileDescriptorNum;
-	char* bytemap = new char[l];
-	char* fileDescriptors = new char[l];
-	char* directoryFile = new char[l];
+	if (block_size < 64 || block_size % 8 != 0)
+		return false;
+	if (descriptor_count < 2 || descriptor_count >= DIR_FLAG || open_files < 1 || name_length < 1 || name_length + BLOCK_NO_SIZE > block_size)
+		return false;
+
+	// superblock + bitmap + descriptor table must leave room for data
+	long long bitmap = ((long long)block_count + block_size * 8 - 1) / (block_size * 8);
+	long long descriptors = ((long long)descriptor_count + block_size / DESCR_SIZE - 1) / (block_size / DESCR_SIZE);
+	if (block_count < 1 || 1 + bitmap + descriptors >= block_count)
+		return false;
+
+	// the disk itself may exceed 2 GiB, but block numbers must stay ints
+	if ((long long)block_count + block_size * 8 > 0x7fffffffLL)
+		return false;
+	return (unsigned long long)block_count * block_size <= (unsigned long long)(size_t)-1;
+}
 
-	bool found = true;
-	char tempChar;
-	int asciiNum;
-	int indexOfDirectory;
-	int indexOfFileDescriptor;
-	int indexOfByteMap;
-	bool alrdyfound = false;
+//done
+void FileSystem53::set_geometry(int block_size, int block_count, int descriptor_count, int open_files, int name_length,
+	char* image, int image_fd)
+{
+	release();
+
+	B = block_size;
+	blockCount = block_count;
+	descriptorCount = descriptor_count;
+	maxOpenFiles = open_files;
+	nameLength = name_length;
+	dirEntrySize = nameLength + BLOCK_NO_SIZE;
+
+	long long pointers = B / BLOCK_NO_SIZE;
+	long long reachable = ARRAY_SIZE + pointers + pointers * pointers;
+	maxFileBlocks = (int)((reachable < 0x7fffffffLL / B) ? reachable : 0x7fffffffLL / B);
+
+	bitmapStart = 1;
+	bitmapBlocks = (blockCount + B * 8 - 1) / (B * 8);
+	descStart = bitmapStart + bitmapBlocks;
+	K = (descriptorCount + B / DESCR_SIZE - 1) / (B / DESCR_SIZE);
+	dataStart = descStart + K;
+
+	diskBytes = (size_t)blockCount * B;
+	if (image != NULL)
+	{
+		ldisk = image;
+		imageFd = image_fd;
+		diskMapped = true;
+	}
+	else
+		ldisk = alloc_disk_image(diskBytes, diskMapped);
+	OpenFileTable();
+
+	blockDirty = new bool[blockCount];
+	memset(blockDirty, 0, blockCount * sizeof(bool));
+	dirtyBlocks.clear();
+	imageCurrent = (image != NULL);
+
+	bitmapWordCount = (blockCount + 63) / 64;
+	bitmapWords = new atomic<uint64_t>[bitmapWordCount];
+	bitmapBlockDirty = new atomic<bool>[bitmapBlocks];
+	bitmapBlockUnlogged = new atomic<bool>[bitmapBlocks];
+	freedWords = new atomic<uint64_t>[bitmapWordCount];
+	bitmapBlockFreed = new atomic<bool>[bitmapBlocks];
+	allocatedWords = new atomic<uint64_t>[bitmapWordCount];
+	bitmapBlockAllocated = new atomic<bool>[bitmapBlocks];
+	for (int word = 0; word < bitmapWordCount; word++)
+	{
+		freedWords[word] = 0;
+		allocatedWords[word] = 0;
+	}
+	for (int b = 0; b < bitmapBlocks; b++)
+	{
+		bitmapBlockDirty[b] = false;
+		bitmapBlockUnlogged[b] = false;
+		bitmapBlockFreed[b] = false;
+		bitmapBlockAllocated[b] = false;
+	}
+	bitmapUnlogged = false;
+	blocksFreed = false;
+	blocksAllocated = false;
 
-	// get bytemap
-	read_block(0, bytemap);
+	zeroBlock = new char[B];
+	memset(zeroBlock, '\0', B);
 
-	// get file descriptors.
-	read_block(1, fileDescriptors);
+	allocate_cache(cacheFrames);
+}
 
-	// get the first filedescriptor  ->  the directory file , and check its three datablocks for the filename
-	for (int i = 1; i < 4; i++)
+//done
+void FileSystem53::release()
+{
+	stop_checkpointer();
+#if defined(FS53_MMAP_IMAGE)
+	stop_journal();
+#endif
+
+	// let the engine finish what it was given before it goes
+	drain_write_behind();
+	for (size_t i = 0; i < OFTable.size(); i++)
+		drop_readahead(*OFTable[i]);
+	stop_io();
+
+	if (ldisk != NULL)
 	{
-		// find and get directory block
-		indexOfDirectory = fileDescriptors[i];
-		read_block(indexOfDirectory, directoryFile);
-
-		int count = 0;
-		for (int j = 0; j < 55; j = count * 11)
+#if defined(FS53_MMAP_IMAGE)
+		if (imageFd >= 0)
 		{
-			found = true;
-			count++;
-			int counter = 0;
-			while (counter < symbolic_file_name.length() && found)
-			{
-				found = (directoryFile[j] == symbolic_file_name[counter]);
-				counter++;
-				j++;
-			}
-
-			// if filename is the same, go to the filedescriptor containing it
-			if (found)
-			{
-				// first thing filedescriptor of file directory points to is the filelength
-				// gets the index of the file descriptor for the file
-				fileDescriptorNum = directoryFile[count*11 - 1];
-				alrdyfound = true;
-
-				break;
-			}
+			// what was not saved goes with the scratch file
+			munmap(ldisk, diskBytes);
+			::close(imageFd);
+			imageFd = -1;
 		}
+		else
+#endif
+			free_disk_image(ldisk, diskBytes, diskMapped);
+		ldisk = NULL;
+		delete[] blockDirty;
+		blockDirty = NULL;
+		dirtyBlocks.clear();
 	}
 
-	if (!alrdyfound)
+	// the buffers are B bytes, B may change
+	for (size_t i = 0; i < OFTable.size(); i++)
 	{
-		delete bytemap;
-		delete fileDescriptors;
-		delete directoryFile;
-		return -1;
+		delete[] OFTable[i]->buffer;
+		delete OFTable[i];
 	}
+	OFTable.clear();
+	freeOft.clear();
+	activeFiles.clear();
+	for (size_t i = 0; i < processes.size(); i++)
+		delete processes[i];
+	processes.clear();
+	freePids.clear();
+	mainProcess = NULL;
+	for (size_t i = 0; i < spareBuffers.size(); i++)
+		delete[] spareBuffers[i];
+	spareBuffers.clear();
+
+	delete[] bitmapWords;
+	bitmapWords = NULL;
+	delete[] bitmapBlockDirty;
+	bitmapBlockDirty = NULL;
+	delete[] bitmapBlockUnlogged;
+	bitmapBlockUnlogged = NULL;
+	delete[] freedWords;
+	freedWords = NULL;
+	delete[] bitmapBlockFreed;
+	bitmapBlockFreed = NULL;
+	delete[] allocatedWords;
+	allocatedWords = NULL;
+	delete[] bitmapBlockAllocated;
+	bitmapBlockAllocated = NULL;
+	delete[] zeroBlock;
+	zeroBlock = NULL;
+
+	delete[] cacheData;
+	cacheData = NULL;
+	delete[] cacheBlock;
+	cacheBlock = NULL;
+	delete[] cacheFrameDirty;
+	cacheFrameDirty = NULL;
+	delete[] cacheReferenced;
+	cacheReferenced = NULL;
+	cacheIndex.clear();
+}
 
-	int freeoft = find_oft();
-	if (freeoft != -1)
-	{
-		// has free oft
-		char a = fileDescriptorNum;
-		OFTable[freeoft][l] = '\0';
-		OFTable[freeoft][l + 1] = a;
-		read_block(1, fileDescriptors);
-		int asciiIndexForFirstBlock = fileDescriptors[fileDescriptorNum + 1];
-		read_block(asciiIndexForFirstBlock, OFTable[freeoft]);
-		oftAllocation[freeoft] = 1;
-		
-		delete bytemap;
-		delete fileDescriptors;
-		delete directoryFile;
-
-		return freeoft;
-	}
-	else
-	{
-		delete bytemap;
-		delete fileDescriptors;
-		delete directoryFile;
-		return -2;
-	}
+//done
+void FileSystem53::allocate_cache(int frames)
+{
+	delete[] cacheData;
+	delete[] cacheBlock;
+	delete[] cacheFrameDirty;
+	delete[] cacheReferenced;
+
+	cacheFrames = frames;
+	cacheData = new char[(size_t)cacheFrames * B];
+	cacheBlock = new int[cacheFrames];
+	cacheFrameDirty = new bool[cacheFrames];
+	cacheReferenced = new bool[cacheFrames];
+	invalidate_cache();
 }
 
 //done
-int FileSystem53::find_oft()
+void FileSystem53::invalidate_cache()
 {
-	for (int i = 0; i < 3; i++)
+	for (int f = 0; f < cacheFrames; f++)
 	{
-		if (oftAllocation[i] == 0)
-			return i;
+		cacheBlock[f] = -1;
+		cacheFrameDirty[f] = false;
+		cacheReferenced[f] = false;
 	}
-	return -1;
+	cacheIndex.clear();
+	clockHand = 0;
 }
 
 //done
-void FileSystem53::directory()
+int FileSystem53::cache_frame(int i)
 {
-	char* directoryFile = new char[l];
-	char* fileDescriptor = new char[l];
+	unordered_map<int, int>::const_iterator cached = cacheIndex.find(i);
+	if (cached != cacheIndex.end())
+	{
+		count_stat(COUNT_CACHE_HITS);
+		cacheReferenced[cached->second] = true;
+		return cached->second;
+	}
+	count_stat(COUNT_CACHE_MISSES);
+	count_stat(COUNT_META_READS);
 
-	read_block(1, fileDescriptor);
+	// CLOCK: give each referenced frame a second chance until an empty or unreferenced one comes up
+	while (cacheBlock[clockHand] != -1 && cacheReferenced[clockHand])
+	{
+		cacheReferenced[clockHand] = false;
+		clockHand = (clockHand + 1) % cacheFrames;
+	}
+	int frame = clockHand;
+	clockHand = (clockHand + 1) % cacheFrames;
 
-	int count = 1;
-	int temp;
-	int numOfFiles = fileDescriptor[0];
-	
-	while (count < 4)
+	char* data = cacheData + (size_t)frame * B;
+	if (cacheBlock[frame] != -1)
 	{
-		if (fileDescriptor[count] != '\0')
+		// ldisk is only a working copy, so a block of an unfinished transaction may go back to it;
+		// end_transaction() still logs the block from there
+		if (cacheFrameDirty[frame])
 		{
-			temp = fileDescriptor[count];
-			read_block(temp, directoryFile);
-
-			int counter = 0;
-			for (int i = 0; i < 55; i = counter * 11)
-			{
-				counter++;
-				//something is there in the 10-byte block
-				if (directoryFile[i] != '\0')
-				{
-					for (int j = i; j < counter * 10; j++)
-					{
-						if (directoryFile[j] != '\0')
-							cout << directoryFile[j];
-					}
-
-					numOfFiles--;
-					if (numOfFiles == 0)
-						cout << " " << (int) fileDescriptor[(int) directoryFile[(counter * 11) - 1]] << " bytes";
-					else
-						cout << " " << (int) fileDescriptor[(int) directoryFile[(counter * 11) - 1]] << " bytes, ";
-				}
-			}
+			memcpy(device_block(cacheBlock[frame]), data, B);
+			count_stat(COUNT_CACHE_WRITEBACKS);
+			count_stat(COUNT_META_WRITES);
 		}
-		count++;
+		cacheIndex.erase(cacheBlock[frame]);
 	}
 
-	delete directoryFile;
-	delete fileDescriptor;
+	wait_write_behind(i);
+	memcpy(data, device_block(i), B);
+	cacheBlock[frame] = i;
+	cacheFrameDirty[frame] = false;
+	cacheReferenced[frame] = true;
+	cacheIndex[i] = frame;
+	return frame;
 }
 
 //done
-int FileSystem53::read(int index, char* mem_area, int count)
+char* FileSystem53::block_for_write(int i)
 {
-	int fileDescriptorIndex = OFTable[index][65];
-	int currentPosition = OFTable[index][64];
-	int blockIndex = currentPosition % 64;
-	int blockNumber;
-	int actualValue = 0;
-
-	char* fileDescriptor = new char[l];
-
-	if (count > 64)
-		count = 64;
-
-	read_block(1, fileDescriptor);
+	int frame = cache_frame(i);
+	cacheFrameDirty[frame] = true;
+	mark_dirty(i);
+	if (journalFd >= 0)
+		journalTouched.insert(i);
+	return cacheData + (size_t)frame * B;
+}
 
-	int fileSize = fileDescriptor[fileDescriptorIndex];
+//done
+void FileSystem53::sync()
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	drain_write_behind();
 
-	if (fileDescriptor[fileDescriptorIndex] == '\0')
+	// the log gets every finished transaction before the image does
+	if (journalFd >= 0)
 	{
-		delete fileDescriptor;
-
-		return -1;
+		end_transaction();
+		journal_write(journal_seal());
 	}
-	
-	blockNumber = (currentPosition / l) + 1;
-	char* file = new char[l];
-	char* buffer = new char[l];
-	
-	for (int i = 0; i < count; i++)
-	{
-		blockNumber = (currentPosition / l) + 1;
-		blockIndex = currentPosition % 64;
 
-		// runs when it reaches the end of a file block
-		//need new file block in buffer
-		if(blockIndex == 0 && blockNumber > 1)
+	for (int f = 0; f < cacheFrames; f++)
+	{
+		if (cacheBlock[f] != -1 && cacheFrameDirty[f])
 		{
+			memcpy(device_block(cacheBlock[f]), cacheData + (size_t)f * B, B);
+			cacheFrameDirty[f] = false;
+			count_stat(COUNT_CACHE_WRITEBACKS);
+			count_stat(COUNT_META_WRITES);
+		}
+	}
+
+	// the flag is cleared before the words are read, so a bit set meanwhile is written next time
+	for (int b = 0; b < bitmapBlocks; b++)
+	{
+		if (!bitmapBlockDirty[b].exchange(false))
+			continue;
+
+		int no = bitmapStart + b;
+		copy_bitmap_block(b, device_block(no));
+
+		unordered_map<int, int>::const_iterator cached = cacheIndex.find(no);
+		if (cached != cacheIndex.end())
+			memcpy(cacheData + (size_t)cached->second * B, device_block(no), B);
+
+		mark_dirty(no);
+		count_stat(COUNT_CACHE_WRITEBACKS);
+		count_stat(COUNT_META_WRITES);
+	}
+}
+
+//done
+void FileSystem53::set_cache_size(int frames)
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	sync();
+	allocate_cache(frames < 1 ? 1 : frames);
+}
+
+//done
+const char* FileSystem53::stat_op_name(int op)
+{
+	static const char* const names[STAT_OPS] = { "create", "open", "read", "write", "lseek", "close", "deleteFile" };
+	return (op >= 0 && op < STAT_OPS) ? names[op] : "";
+}
+
+//done
+FileSystem53::Stats FileSystem53::stats() const
+{
+	Stats stats;
+	memset(&stats, 0, sizeof(stats));
+#if defined(FS53_STATS)
+	for (int op = 0; op < STAT_OPS; op++)
+	{
+		stats.calls[op] = opCalls[op].load(memory_order_relaxed);
+		stats.nanoseconds[op] = opNanoseconds[op].load(memory_order_relaxed);
+	}
+#endif
+	stats.metaReads = statCounts[COUNT_META_READS].load(memory_order_relaxed);
+	stats.metaWrites = statCounts[COUNT_META_WRITES].load(memory_order_relaxed);
+	stats.dataReads = statCounts[COUNT_DATA_READS].load(memory_order_relaxed);
+	stats.dataWrites = statCounts[COUNT_DATA_WRITES].load(memory_order_relaxed);
+	stats.allocatorScans = statCounts[COUNT_ALLOC_SCANS].load(memory_order_relaxed);
+	stats.allocatorWords = statCounts[COUNT_ALLOC_WORDS].load(memory_order_relaxed);
+	stats.oftReloads = statCounts[COUNT_OFT_RELOADS].load(memory_order_relaxed);
+	stats.cacheHits = statCounts[COUNT_CACHE_HITS].load(memory_order_relaxed);
+	stats.cacheMisses = statCounts[COUNT_CACHE_MISSES].load(memory_order_relaxed);
+	stats.cacheWritebacks = statCounts[COUNT_CACHE_WRITEBACKS].load(memory_order_relaxed);
+	return stats;
+}
+
+//done
+void FileSystem53::reset_stats()
+{
+#if defined(FS53_STATS)
+	for (int op = 0; op < STAT_OPS; op++)
+	{
+		opCalls[op] = 0;
+		opNanoseconds[op] = 0;
+	}
+#endif
+	for (int c = 0; c < COUNT_KINDS; c++)
+		statCounts[c] = 0;
+}
+
+//done
+void FileSystem53::format()
+{
+	// zero the superblock, bitmap and descriptor table
+	for (int i = 0; i < dataStart; i++)
+		write_block(i, zeroBlock);
+
+	char* block = block_for_write(0);
+
+	put_int(block + SB_MAGIC * 4, FS_MAGIC);
+	put_int(block + SB_BLOCK_SIZE * 4, B);
+	put_int(block + SB_BLOCK_COUNT * 4, blockCount);
+	put_int(block + SB_DESCRIPTORS * 4, descriptorCount);
+	put_int(block + SB_OPEN_FILES * 4, maxOpenFiles);
+	put_int(block + SB_NAME_LEN * 4, nameLength);
+	put_int(block + SB_BITMAP_START * 4, bitmapStart);
+	put_int(block + SB_BITMAP_BLOCKS * 4, bitmapBlocks);
+	put_int(block + SB_DESC_START * 4, descStart);
+	put_int(block + SB_DESC_BLOCKS * 4, K);
+	put_int(block + SB_DATA_START * 4, dataStart);
+
+	// superblock, bitmap and descriptor blocks are always in use, and so are the bits past the last block
+	for (int i = 0; i < bitmapWordCount; i++)
+	{
+		bitmapWords[i] = 0;
+		freedWords[i] = 0;
+		allocatedWords[i] = 0;
+	}
+	blocksFreed = false;
+	blocksAllocated = false;
+	bitmapGeneration = nextGeneration++;
+	hintThreads = 0;
+	for (int i = 0; i < dataStart; i++)
+		mark_block(i, true);
+	for (int i = blockCount; i < bitmapWordCount * 64; i++)
+		mark_block(i, true);
+
+	descHint = 1;
+	dentryCache.clear();
+	OpenFileTable();
+
+#if defined(FS53_MMAP_IMAGE)
+	// the old records describe another file system
+	if (journalFd >= 0)
+		journal_checkpoint();
+#endif
+}
+
+//done
+int FileSystem53::format(int block_size, int block_count, int descriptor_count, int open_files, int name_length)
+{
+	if (!valid_geometry(block_size, block_count, descriptor_count, open_files, name_length))
+		return -1;
+
+	set_geometry(block_size, block_count, descriptor_count, open_files, name_length);
+	format();
+	start_checkpointer();
+	return 0;
+}
+
+//done
+int FileSystem53::mount()
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	const char* block = this->block(0);
+
+	if (get_int(block + SB_MAGIC * 4) != FS_MAGIC)
+		return -1;
+
+	int block_size = get_int(block + SB_BLOCK_SIZE * 4);
+	int block_count = get_int(block + SB_BLOCK_COUNT * 4);
+	int descriptor_count = get_int(block + SB_DESCRIPTORS * 4);
+	int open_files = get_int(block + SB_OPEN_FILES * 4);
+	int name_length = get_int(block + SB_NAME_LEN * 4);
+
+	if (!valid_geometry(block_size, block_count, descriptor_count, open_files, name_length))
+		return -1;
+	if (block_size != B || block_count != blockCount)
+		return -1;
+
+	// the layout must be the one set_geometry() sized the bitmap and descriptor arrays for
+	int descriptorBlocks = (descriptor_count + B / DESCR_SIZE - 1) / (B / DESCR_SIZE);
+	if (get_int(block + SB_BITMAP_START * 4) != bitmapStart || get_int(block + SB_BITMAP_BLOCKS * 4) != bitmapBlocks
+		|| get_int(block + SB_DESC_START * 4) != descStart || get_int(block + SB_DESC_BLOCKS * 4) != descriptorBlocks
+		|| get_int(block + SB_DATA_START * 4) != descStart + descriptorBlocks || descStart + descriptorBlocks >= blockCount)
+		return -1;
+
+	descriptorCount = descriptor_count;
+	nameLength = name_length;
+	dirEntrySize = nameLength + BLOCK_NO_SIZE;
+	K = descriptorBlocks;
+	dataStart = descStart + K;
+
+	load_bitmap();
+	descHint = 1;
+	dentryCache.clear();
+	return 0;
+}
+
+//done
+void FileSystem53::mark_block(int no, bool used)
+{
+	int word = no / 64;
+	uint64_t bit = (uint64_t)1 << (no % 64);
+
+	if (used)
+		bitmapWords[word].fetch_or(bit);
+	else
+		bitmapWords[word].fetch_and(~bit);
+
+	// the bitmap block is written back on sync()
+	bitmap_word_changed(word);
+}
+
+//done
+void FileSystem53::load_bitmap()
+{
+	for (int word = 0; word < bitmapWordCount; word++)
+	{
+		int offset = word * (int)sizeof(uint64_t);
+		uint64_t value;
+		memcpy(&value, device_block(bitmapStart + offset / B) + offset % B, sizeof(value));
+		bitmapWords[word] = value;
+	}
+	for (int word = 0; word < bitmapWordCount; word++)
+	{
+		freedWords[word] = 0;
+		allocatedWords[word] = 0;
+	}
+	for (int b = 0; b < bitmapBlocks; b++)
+	{
+		bitmapBlockDirty[b] = false;
+		bitmapBlockUnlogged[b] = false;
+		bitmapBlockFreed[b] = false;
+		bitmapBlockAllocated[b] = false;
+	}
+	bitmapUnlogged = false;
+	blocksFreed = false;
+	blocksAllocated = false;
+	bitmapGeneration = nextGeneration++;
+	hintThreads = 0;
+}
+
+//done
+int& FileSystem53::alloc_hint()
+{
+	if (threadHint.generation != bitmapGeneration)
+	{
+		int n = hintThreads++;
+		threadHint.generation = bitmapGeneration;
+		threadHint.word = (int)((long long)(n % HINT_SPREAD) * bitmapWordCount / HINT_SPREAD);
+	}
+	return threadHint.word;
+}
+
+//done
+int FileSystem53::allocate_block(int goal)
+{
+	// setting the goal's bit claims it, unless another allocation got there first
+	if (goal >= dataStart && goal < blockCount)
+	{
+		uint64_t bit = (uint64_t)1 << (goal % 64);
+		if ((bitmapWords[goal / 64].fetch_or(bit) & bit) == 0)
+		{
+			bitmap_word_changed(goal / 64);
+			bits_allocated(goal / 64, bit);
+			return goal;
+		}
+	}
+
+	int no;
+	return (allocate_blocks(1, &no) == 1) ? no : -1;
+}
+
+//done
+int FileSystem53::allocate_blocks(int count, int* blocks, int goal)
+{
+	int& hint = alloc_hint();
+	int start = (goal >= 0 && goal < blockCount) ? goal / 64 : hint;
+	int claimed = 0;
+	int n = 0;
+
+	for (; n < bitmapWordCount && claimed < count; n++)
+	{
+		int word = (start + n) % bitmapWordCount;
+		uint64_t old = bitmapWords[word].load(memory_order_relaxed);
+
+		for (;;)
+		{
+			// the lowest free bits this word can give, all claimed by one compare-and-swap
+			uint64_t freeBits = ~old;
+			uint64_t take = 0;
+			for (int want = count - claimed; freeBits != 0 && want > 0; want--)
+			{
+				uint64_t bit = freeBits & (~freeBits + 1);
+				if (word * 64 + count_trailing_zeros(bit) >= blockCount)
+					break;
+				take |= bit;
+				freeBits &= freeBits - 1;
+			}
+			if (take == 0)
+				break;
+
+			// on failure 'old' is reloaded and the word is tried again
+			if (bitmapWords[word].compare_exchange_weak(old, old | take))
+			{
+				bits_allocated(word, take);
+				for (; take != 0; take &= take - 1)
+					blocks[claimed++] = word * 64 + count_trailing_zeros(take);
+				bitmap_word_changed(word);
+				hint = word;
+				break;
+			}
+		}
+	}
+	count_stat(COUNT_ALLOC_SCANS);
+	count_stat(COUNT_ALLOC_WORDS, n);
+
+	// blocks freed since the last transaction ended are not back in the bitmap yet
+	if (claimed < count && blocksFreed.load())
+	{
+		{
+			lock_guard<MetaMutex> guard(metaLock);
+			release_freed_blocks();
+		}
+		claimed += allocate_blocks(count - claimed, blocks + claimed, goal);
+	}
+	return claimed;
+}
+
+//done
+void FileSystem53::free_block(int no)
+{
+	if (no < dataStart || no >= blockCount)
+		return;
+
+	// the block may hold file data next, older journal images of it must not be replayed over that,
+	// so it stays in use until end_transaction() has revoked them
+	if (journalFd >= 0)
+	{
+		int word = no / 64;
+		freedWords[word].fetch_or((uint64_t)1 << (no % 64));
+		bitmapBlockFreed[word * (int)sizeof(uint64_t) / B].store(true);
+		blocksFreed.store(true);
+		return;
+	}
+	mark_block(no, false);
+}
+
+//done
+char* FileSystem53::read_descriptor(int no, char* desc)
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	memcpy(desc, block(descriptor_block(no)) + descriptor_offset(no), DESCR_SIZE);
+	return desc;
+}
+
+//done
+void FileSystem53::write_descriptor(int no, char* desc)
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	memcpy(block_for_write(descriptor_block(no)) + descriptor_offset(no), desc, DESCR_SIZE);
+}
+
+//done
+void FileSystem53::clear_descriptor(int no)
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	char desc[DESCR_SIZE];
+	read_descriptor(no, desc);
+
+	free_file_blocks(desc);
+
+	memset(desc, '\0', DESCR_SIZE);
+	write_descriptor(no, desc);
+
+	if (no < descHint)
+		descHint = no;
+}
+
+//done
+int FileSystem53::find_empty_descriptor()
+{
+	lock_guard<MetaMutex> guard(metaLock);
+
+	// descriptor 0 is the root directory; starting at the hint keeps the scan from cycling the cache
+	for (int no = descHint; no < descriptorCount; no++)
+	{
+		if (get_int(block(descriptor_block(no)) + descriptor_offset(no) + FILE_SIZE_FIELD) == 0)
+		{
+			descHint = no;
+			return no;
+		}
+	}
+	descHint = descriptorCount;
+	return -1;
+}
+
+//done
+int FileSystem53::map_slot(char* container, int offset, bool allocate, bool indirect, int goal, bool& changed,
+	BlockReserve* reserve)
+{
+	int blockNo = get_int(container + offset);
+	if (blockNo != 0 || !allocate)
+		return blockNo;
+
+	// place the block right after its left neighbour when there is one
+	if (offset >= BLOCK_NO_SIZE && get_int(container + offset - BLOCK_NO_SIZE) != 0)
+		goal = get_int(container + offset - BLOCK_NO_SIZE) + 1;
+
+	if (reserve != NULL && reserve->next < reserve->blocks.size())
+		blockNo = reserve->blocks[reserve->next++];
+	else
+		blockNo = allocate_block(goal);
+	if (blockNo == -1)
+		return -1;
+
+	// an indirect block starts out with no block numbers
+	if (indirect)
+		write_block(blockNo, zeroBlock);
+
+	put_int(container + offset, blockNo);
+	changed = true;
+	return blockNo;
+}
+
+//done
+int FileSystem53::map_block(int desc_no, int blockNumber, bool allocate)
+{
+	return map_block(desc_no, blockNumber, allocate, NULL);
+}
+
+//done
+int FileSystem53::map_block(int desc_no, int blockNumber, bool allocate, BlockReserve* reserve)
+{
+	if (blockNumber < 0 || blockNumber >= maxFileBlocks)
+		return -1;
+
+	lock_guard<MetaMutex> guard(metaLock);
+	int pointers = B / BLOCK_NO_SIZE;
+	bool changed = false;
+	int blockNo;
+	char desc[DESCR_SIZE];
+	read_descriptor(desc_no, desc);
+
+	if (blockNumber < ARRAY_SIZE)
+	{
+		blockNo = map_slot(desc, FILE_SIZE_FIELD + blockNumber * BLOCK_NO_SIZE, allocate, false, -1, changed, reserve);
+		if (changed)
+			write_descriptor(desc_no, desc);
+		return blockNo;
+	}
+
+	int goal = get_int(desc + FILE_SIZE_FIELD + (ARRAY_SIZE - 1) * BLOCK_NO_SIZE);
+	int level;  // number of indirect blocks between the descriptor and the data block
+	int slot;   // offset of the indirect block number in the descriptor
+
+	blockNumber -= ARRAY_SIZE;
+	if (blockNumber < pointers)
+	{
+		level = 1;
+		slot = SINGLE_INDIRECT;
+	}
+	else
+	{
+		blockNumber -= pointers;
+		level = 2;
+		slot = DOUBLE_INDIRECT;
+	}
+
+	blockNo = map_slot(desc, slot, allocate, true, goal != 0 ? goal + 1 : -1, changed, reserve);
+	if (changed)
+		write_descriptor(desc_no, desc);
+
+	// walk down the indirect blocks, the index at each level comes from the digits of blockNumber in base 'pointers'
+	for (int divisor = (level == 2) ? pointers : 1; blockNo > 0; divisor /= pointers)
+	{
+		int container = blockNo;
+		int offset = ((blockNumber / divisor) % pointers) * BLOCK_NO_SIZE;
+
+		// the indirect block is only written, in place, when a slot gets filled
+		blockNo = get_int(block(container) + offset);
+		if (blockNo == 0 && allocate)
+			blockNo = map_slot(block_for_write(container), offset, true, divisor > 1, container + 1, changed, reserve);
+
+		if (divisor == 1)
+			break;
+	}
+
+	return blockNo;
+}
+
+//done
+void FileSystem53::walk_file_blocks(const char* desc, const function<void(int)>& visit)
+{
+	int pointers = B / BLOCK_NO_SIZE;
+
+	for (int i = 0; i < ARRAY_SIZE; i++)
+	{
+		int blockNo = get_int(desc + FILE_SIZE_FIELD + i * BLOCK_NO_SIZE);
+		if (blockNo != 0)
+			visit(blockNo);
+	}
+
+	// the indirect blocks are read in place and visited after the blocks they point to
+	int singleNo = get_int(desc + SINGLE_INDIRECT);
+	if (singleNo != 0)
+	{
+		const char* data = block(singleNo);
+		for (int i = 0; i < pointers; i++)
+		{
+			if (get_int(data + i * BLOCK_NO_SIZE) != 0)
+				visit(get_int(data + i * BLOCK_NO_SIZE));
+		}
+		visit(singleNo);
+	}
+
+	int doubleNo = get_int(desc + DOUBLE_INDIRECT);
+	if (doubleNo != 0)
+	{
+		for (int i = 0; i < pointers; i++)
+		{
+			// looked up again each time, reading the single indirect block may evict it
+			singleNo = get_int(block(doubleNo) + i * BLOCK_NO_SIZE);
+			if (singleNo == 0)
+				continue;
+
+			const char* data = block(singleNo);
+			for (int j = 0; j < pointers; j++)
+			{
+				if (get_int(data + j * BLOCK_NO_SIZE) != 0)
+					visit(get_int(data + j * BLOCK_NO_SIZE));
+			}
+			visit(singleNo);
+		}
+		visit(doubleNo);
+	}
+}
+
+//done
+void FileSystem53::free_file_blocks(char* desc)
+{
+	// freeing only touches the bitmap, so the walk can keep reading the indirect blocks
+	walk_file_blocks(desc, [this](int blockNo) { free_block(blockNo); });
+}
+
+//done
+int FileSystem53::count_file_blocks(const char* desc)
+{
+	int blocks = 0;
+	walk_file_blocks(desc, [&blocks](int) { blocks++; });
+	return blocks;
+}
+
+//done
+void FileSystem53::read_block(int i,  char *p)
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	unordered_map<int, int>::const_iterator cached = cacheIndex.find(i);
+	if (cached != cacheIndex.end())
+	{
+		memcpy(p, cacheData + (size_t)cached->second * B, B);
+		return;
+	}
+	count_stat((i < dataStart) ? COUNT_META_READS : COUNT_DATA_READS);
+	if (!read_write_behind(i, p))
+		memcpy(p, device_block(i), B);
+}
+
+//done
+void FileSystem53::write_block(int i,  const char *p)
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	unordered_map<int, int>::const_iterator cached = cacheIndex.find(i);
+	if (cached != cacheIndex.end())
+	{
+		// counted when the frame goes back to ldisk
+		memcpy(cacheData + (size_t)cached->second * B, p, B);
+		cacheFrameDirty[cached->second] = true;
+	}
+	else
+	{
+		count_stat((i < dataStart) ? COUNT_META_WRITES : COUNT_DATA_WRITES);
+		wait_write_behind(i);
+		memcpy(device_block(i), p, B);
+	}
+	mark_dirty(i);
+}
+
+//done
+AsyncIo* FileSystem53::io()
+{
+	if (ioEngine == NULL)
+	{
+#if defined(FS53_IO_URING)
+		if (imageFd >= 0)
+			ioEngine = UringIo::create(imageFd, IO_QUEUE_DEPTH);
+#endif
+		if (ioEngine == NULL)
+		{
+			int threads = (int)thread::hardware_concurrency();
+			ioEngine = new ThreadPoolIo(ldisk, imageFd, (threads < 2) ? 2 : (threads > 8 ? 8 : threads));
+		}
+	}
+	return ioEngine;
+}
+
+//done
+void FileSystem53::submit_io(bool write, char* data, int i, IoCallback done)
+{
+	AsyncIo* engine;
+	{
+		lock_guard<mutex> guard(ioLock);
+		engine = io();
+		ioUsers++;
+	}
+
+	engine->submit(write, data, B, (uint64_t)i * B, done);
+
+	lock_guard<mutex> guard(ioLock);
+	if (--ioUsers == 0)
+		ioIdle.notify_all();
+}
+
+//done
+void FileSystem53::stop_io()
+{
+	// new submitters wait on ioLock until the engine is gone; its destructor runs what was queued
+	unique_lock<mutex> guard(ioLock);
+	while (ioUsers != 0)
+		ioIdle.wait(guard);
+	delete ioEngine;
+	ioEngine = NULL;
+}
+
+//done
+void FileSystem53::read_block_async(int i, char* p, IoCallback done)
+{
+	bool cached;
+	{
+		lock_guard<MetaMutex> guard(metaLock);
+		unordered_map<int, int>::const_iterator frame = cacheIndex.find(i);
+		cached = (frame != cacheIndex.end());
+		if (cached)
+			memcpy(p, cacheData + (size_t)frame->second * B, B);
+		else
+		{
+			count_stat((i < dataStart) ? COUNT_META_READS : COUNT_DATA_READS);
+			cached = read_write_behind(i, p);
+		}
+	}
+
+	// the callback may call back into the file system, so it runs without the lock
+	if (cached)
+		done(B);
+	else
+		submit_io(false, p, i, done);
+}
+
+//done
+void FileSystem53::write_block_async(int i, const char* p, IoCallback done)
+{
+	bool cached;
+	{
+		lock_guard<MetaMutex> guard(metaLock);
+		unordered_map<int, int>::const_iterator frame = cacheIndex.find(i);
+		cached = (frame != cacheIndex.end());
+		if (cached)
+		{
+			memcpy(cacheData + (size_t)frame->second * B, p, B);
+			cacheFrameDirty[frame->second] = true;
+		}
+		else
+		{
+			count_stat((i < dataStart) ? COUNT_META_WRITES : COUNT_DATA_WRITES);
+			wait_write_behind(i);
+		}
+		mark_dirty(i);
+	}
+
+	if (cached)
+		done(B);
+	else
+		submit_io(true, (char*)p, i, done);
+}
+
+//done
+future<int> FileSystem53::read_block_async(int i, char* p)
+{
+	shared_ptr<promise<int> > result = make_shared<promise<int> >();
+	read_block_async(i, p, [result](int n) { result->set_value(n); });
+	return result->get_future();
+}
+
+//done
+future<int> FileSystem53::write_block_async(int i, const char* p)
+{
+	shared_ptr<promise<int> > result = make_shared<promise<int> >();
+	write_block_async(i, p, [result](int n) { result->set_value(n); });
+	return result->get_future();
+}
+
+//done
+int FileSystem53::read_blocks(const vector<int>& blocks, const vector<char*>& buffers)
+{
+	IoBatch batch;
+	batch.pending = (int)blocks.size();
+	batch.failed = false;
+
+	int blockSize = B;
+	IoCallback done = [&batch, blockSize](int n)
+	{
+		lock_guard<mutex> guard(batch.lock);
+		if (n != blockSize)
+			batch.failed = true;
+		if (--batch.pending == 0)
+			batch.done.notify_all();
+	};
+
+	for (size_t k = 0; k < blocks.size(); k++)
+		read_block_async(blocks[k], buffers[k], done);
+
+	wait_batch(batch);
+	return batch.failed ? -1 : 0;
+}
+
+//done
+void FileSystem53::wait_batch(IoBatch& batch)
+{
+	unique_lock<mutex> guard(batch.lock);
+	while (batch.pending != 0)
+		batch.done.wait(guard);
+}
+
+//done
+char* FileSystem53::write_behind(int blockNo, char* data)
+{
+	{
+		unique_lock<mutex> guard(writeBehindLock);
+		while (writesInFlight >= WRITE_BEHIND_LIMIT)
+			writeBehindDone.wait(guard);
+	}
+
+	char* spare = NULL;
+	{
+		// a cached block is written through the cache, and one write per block is in flight at a time
+		lock_guard<MetaMutex> guard(metaLock);
+		if (cacheIndex.find(blockNo) != cacheIndex.end())
+			return NULL;
+		mark_dirty(blockNo);
+
+		unique_lock<mutex> behindGuard(writeBehindLock);
+		while (writesBehind.find(blockNo) != writesBehind.end())
+			writeBehindDone.wait(behindGuard);
+		writesBehind[blockNo] = data;
+		writesInFlight++;
+		if (!spareBuffers.empty())
+		{
+			spare = spareBuffers.back();
+			spareBuffers.pop_back();
+		}
+	}
+	if (spare == NULL)
+		spare = new char[B];
+
+	// nobody else writes the block until the callback is done, so a failed write can still be copied in
+	int blockSize = B;
+	submit_io(true, data, blockNo, [this, blockNo, data, blockSize](int n)
+	{
+		lock_guard<mutex> guard(writeBehindLock);
+		if (n != blockSize)
+			memcpy(device_block(blockNo), data, blockSize);
+		writesBehind.erase(blockNo);
+		spareBuffers.push_back(data);
+		writesInFlight--;
+		writeBehindDone.notify_all();
+	});
+	return spare;
+}
+
+//done
+void FileSystem53::wait_write_behind(int i)
+{
+	if (writesInFlight == 0)
+		return;
+
+	unique_lock<mutex> guard(writeBehindLock);
+	while (writesBehind.find(i) != writesBehind.end())
+		writeBehindDone.wait(guard);
+}
+
+//done
+bool FileSystem53::read_write_behind(int i, char* p)
+{
+	if (writesInFlight == 0)
+		return false;
+
+	lock_guard<mutex> guard(writeBehindLock);
+	unordered_map<int, char*>::const_iterator pending = writesBehind.find(i);
+	if (pending == writesBehind.end())
+		return false;
+	memcpy(p, pending->second, B);
+	return true;
+}
+
+//done
+void FileSystem53::drain_write_behind()
+{
+	unique_lock<mutex> guard(writeBehindLock);
+	while (writesInFlight != 0)
+		writeBehindDone.wait(guard);
+}
+
+//done
+void FileSystem53::save()
+{
+	if (!save_image())
+		cout << "\nUnable to write disk image.";
+}
+
+//done
+bool FileSystem53::save_image()
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	sync();
+
+#if defined(FS53_MMAP_IMAGE)
+	if (imageFd < 0 && !attach_image())
+		return false;
+#endif
+
+	if (!write_dirty())
+		return false;
+
+#if defined(FS53_MMAP_IMAGE)
+	// the image now holds everything the journal does
+	journal_reset();
+#endif
+	return true;
+}
+
+//done
+bool FileSystem53::write_dirty()
+{
+#if defined(FS53_MMAP_IMAGE)
+	int image = imageCurrent ? ::open(DISK_IMAGE, O_WRONLY) : -1;
+	if (image < 0)
+	{
+		// an image of some other disk is rewritten whole
+		image = ::open(DISK_IMAGE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (image < 0)
+			return false;
+		bool ok = write_at(image, ldisk, diskBytes, 0) && sync_file(image) == 0;
+		::close(image);
+		if (!ok)
+			return false;
+		imageCurrent = true;
+		clear_dirty();
+		return true;
+	}
+#else
+	// an image of some other disk is rewritten whole
+	if (!imageCurrent)
+	{
+		ofstream image(DISK_IMAGE, ios::binary | ios::trunc);
+		image.write(ldisk, diskBytes);
+		image.close();
+		if (!image)
+			return false;
+		imageCurrent = true;
+		clear_dirty();
+		return true;
+	}
+
+	fstream image(DISK_IMAGE, ios::binary | ios::in | ios::out);
+	if (!image.is_open())
+	{
+		imageCurrent = false;
+		return write_dirty();
+	}
+#endif
+
+	vector<int> blocks(dirtyBlocks);
+	sort(blocks.begin(), blocks.end());
+
+	bool ok = true;
+	for (size_t k = 0; k < blocks.size(); )
+	{
+		size_t end = k + 1;
+		while (end < blocks.size() && blocks[end] == blocks[end - 1] + 1)
+			end++;
+		size_t first = (size_t)blocks[k] * B;
+		size_t last = ((size_t)blocks[end - 1] + 1) * B;
+		k = end;
+
+#if defined(FS53_MMAP_IMAGE)
+		if (!write_at(image, ldisk + first, last - first, (off_t)first))
+			ok = false;
+#else
+		image.seekp((streamoff)first);
+		image.write(ldisk + first, (streamsize)(last - first));
+#endif
+	}
+
+#if defined(FS53_MMAP_IMAGE)
+	// the journal is emptied after this, so the blocks must be on the device first
+	if (sync_file(image) != 0)
+		ok = false;
+	::close(image);
+#else
+	image.close();
+	ok = !image.fail();
+#endif
+	if (ok)
+		clear_dirty();
+	return ok;
+}
+
+//done
+int FileSystem53::checkpoint_every(int ms)
+{
+	if (ms < 0)
+		return -1;
+
+	stop_checkpointer();
+	checkpointMs = ms;
+	start_checkpointer();
+	return 0;
+}
+
+//done
+void FileSystem53::start_checkpointer()
+{
+	if (checkpointMs <= 0 || checkpointThread.joinable())
+		return;
+
+	checkpointStop = false;
+	checkpointThread = thread(&FileSystem53::checkpointer, this);
+}
+
+//done
+void FileSystem53::stop_checkpointer()
+{
+	if (!checkpointThread.joinable())
+		return;
+
+	{
+		lock_guard<mutex> guard(checkpointLock);
+		checkpointStop = true;
+	}
+	checkpointWake.notify_all();
+	checkpointThread.join();
+}
+
+//done
+void FileSystem53::checkpointer()
+{
+	unique_lock<mutex> guard(checkpointLock);
+	while (!checkpointStop)
+	{
+		checkpointWake.wait_for(guard, chrono::milliseconds((int64_t)checkpointMs));
+		if (checkpointStop)
+			break;
+
+		// save_image() takes metaLock, which ranks above checkpointLock; nothing is printed from here
+		guard.unlock();
+		if (!save_image())
+			checkpointFailures++;
+		guard.lock();
+	}
+}
+
+#if defined(FS53_MMAP_IMAGE)
+//done
+bool FileSystem53::attach_image()
+{
+	int fd = create_work_image(-1, diskBytes);
+	if (fd < 0)
+		return false;
+
+	void* image = mmap(NULL, diskBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (image == MAP_FAILED)
+	{
+		::close(fd);
+		return false;
+	}
+
+	// the engine works on the old ldisk
+	stop_io();
+	memcpy(image, ldisk, diskBytes);
+	free_disk_image(ldisk, diskBytes, diskMapped);
+	ldisk = (char*)image;
+	imageFd = fd;
+	diskMapped = true;
+
+	// DISK_IMAGE may hold another disk
+	imageCurrent = false;
+	start_journal();
+	return true;
+}
+#endif
+
+//done
+void FileSystem53::restore()
+{
+	char header[SB_FIELDS * 4];
+	long long imageBytes = -1;
+
+	// a checkpoint must not save the disk while it is read back
+	stop_checkpointer();
+
+#if defined(FS53_MMAP_IMAGE)
+	int fd = ::open(DISK_IMAGE, O_RDONLY);
+	if (fd < 0)
+	{
+		cout << "\nUnable to open file.";
+		start_checkpointer();
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && pread(fd, header, sizeof(header), 0) == (ssize_t)sizeof(header))
+		imageBytes = st.st_size;
+#else
+	ifstream image(DISK_IMAGE, ios::binary);
+	if (!image.is_open())
+	{
+		cout << "\nUnable to open file.";
+		start_checkpointer();
+		return;
+	}
+
+	image.seekg(0, ios::end);
+	long long length = image.tellg();
+	image.seekg(0, ios::beg);
+	if (image.read(header, sizeof(header)))
+		imageBytes = length;
+#endif
+
+	// the image may have been formatted with another geometry
+	int block_size = get_int(header + SB_BLOCK_SIZE * 4);
+	int block_count = get_int(header + SB_BLOCK_COUNT * 4);
+	int descriptor_count = get_int(header + SB_DESCRIPTORS * 4);
+	int open_files = get_int(header + SB_OPEN_FILES * 4);
+	int name_length = get_int(header + SB_NAME_LEN * 4);
+
+	if (imageBytes < 0 || get_int(header + SB_MAGIC * 4) != FS_MAGIC
+		|| !valid_geometry(block_size, block_count, descriptor_count, open_files, name_length)
+		|| imageBytes < (long long)block_size * block_count)
+	{
+#if defined(FS53_MMAP_IMAGE)
+		::close(fd);
+#endif
+		cout << "\nUnable to read disk image.";
+		start_checkpointer();
+		return;
+	}
+
+#if defined(FS53_MMAP_IMAGE)
+	// the working copy is private, so changes since the last save() never reach DISK_IMAGE
+	size_t bytes = (size_t)block_size * block_count;
+	int work = create_work_image(fd, bytes);
+	::close(fd);
+	void* mapped = (work < 0) ? MAP_FAILED : mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, work, 0);
+	if (mapped == MAP_FAILED)
+	{
+		if (work >= 0)
+			::close(work);
+		cout << "\nUnable to read disk image.";
+		start_checkpointer();
+		return;
+	}
+
+	// this session's journal holds exactly what is being thrown away; one left by a crash is replayed
+	bool crashed = (journalFd < 0);
+	stop_journal();
+	set_geometry(block_size, block_count, descriptor_count, open_files, name_length, (char*)mapped, work);
+	if (crashed)
+		journal_replay();
+#else
+	if (block_size != B || block_count != blockCount || open_files != maxOpenFiles)
+		set_geometry(block_size, block_count, descriptor_count, open_files, name_length);
+	image.seekg(0, ios::beg);
+	image.read(ldisk, diskBytes);
+	imageCurrent = true;
+#endif
+
+	invalidate_cache();
+	clear_dirty();
+	if (mount() != 0)
+	{
+		// the image is gone from ldisk already, so a blank disk of the same geometry takes its place
+		cout << "\nUnable to read disk image.";
+		format();
+	}
+	OpenFileTable();
+#if defined(FS53_MMAP_IMAGE)
+	start_journal();
+#endif
+	start_checkpointer();
+}
+
+//done
+void FileSystem53::copy_bitmap_block(int b, char* p)
+{
+	// the last bitmap block may be only partly covered by the words
+	int wordsPerBlock = B / (int)sizeof(uint64_t);
+	for (int w = b * wordsPerBlock; w < (b + 1) * wordsPerBlock && w < bitmapWordCount; w++)
+	{
+		uint64_t word = bitmapWords[w].load();
+		memcpy(p + (w - b * wordsPerBlock) * sizeof(uint64_t), &word, sizeof(word));
+	}
+}
+
+//done
+int FileSystem53::commit()
+{
+	if (journalFd < 0)
+		return -1;
+
+	uint64_t seq;
+	{
+		lock_guard<MetaMutex> guard(metaLock);
+		end_transaction();
+		seq = journal_seal();
+	}
+	return journal_write(seq) ? 0 : -1;
+}
+
+//done
+void FileSystem53::end_transaction()
+{
+	// blocks queued while the journal ran are released even once it has stopped
+	release_freed_blocks();
+	if (journalFd < 0)
+		return;
+
+	for (unordered_set<int>::const_iterator touched = journalTouched.begin(); touched != journalTouched.end(); ++touched)
+		journal_capture(*touched);
+	journalTouched.clear();
+
+	// an allocation is noted before anything points at the block, so its zeroing is never logged later than that
+	if (blocksAllocated.load() && blocksAllocated.exchange(false))
+	{
+		int wordsPerBlock = B / (int)sizeof(uint64_t);
+		for (int b = 0; b < bitmapBlocks; b++)
+		{
+			if (!bitmapBlockAllocated[b].exchange(false))
+				continue;
+
+			int last = (b + 1) * wordsPerBlock;
+			if (last > bitmapWordCount)
+				last = bitmapWordCount;
+			for (int word = b * wordsPerBlock; word < last; word++)
+			{
+				for (uint64_t allocated = allocatedWords[word].exchange(0); allocated != 0; allocated &= allocated - 1)
+					batchZeroes.push_back(word * 64 + count_trailing_zeros(allocated));
+			}
+		}
+	}
+
+	// bits may have been set by allocations outside metaLock too; at worst the log shows such a
+	// block in use before anything refers to it
+	if (bitmapUnlogged.load() && bitmapUnlogged.exchange(false))
+	{
+		for (int b = 0; b < bitmapBlocks; b++)
+		{
+			if (bitmapBlockUnlogged[b].exchange(false))
+				journal_capture(bitmapStart + b);
+		}
+	}
+}
+
+//done
+void FileSystem53::journal_capture(int i)
+{
+	int entry;
+	unordered_map<int, int>::const_iterator slot = batchSlot.find(i);
+	if (slot != batchSlot.end())
+		entry = slot->second;
+	else
+	{
+		entry = (int)batchBlocks.size();
+		batchBlocks.push_back(i);
+		batchImages.resize(batchImages.size() + B);
+		batchSlot[i] = entry;
+	}
+
+	char* image = &batchImages[(size_t)entry * B];
+	unordered_map<int, int>::const_iterator cached = cacheIndex.find(i);
+	memcpy(image, (cached != cacheIndex.end()) ? cacheData + (size_t)cached->second * B : device_block(i), B);
+	if (i >= bitmapStart && i < bitmapStart + bitmapBlocks)
+		copy_bitmap_block(i - bitmapStart, image);
+}
+
+//done
+uint64_t FileSystem53::journal_seal()
+{
+	if (batchSlot.empty() && batchRevokes.empty() && batchZeroes.empty())
+	{
+		batchBlocks.clear();
+		batchImages.clear();
+		return journalSeq;
+	}
+
+	int images = (int)batchSlot.size();
+	int revokes = (int)batchRevokes.size();
+	int zeroes = (int)batchZeroes.size();
+	uint64_t seq = ++journalSeq;
+
+	// header, the blocks imaged, the blocks revoked, the blocks zeroed, then the images
+	vector<char> record(RECORD_HEADER + ((size_t)images + revokes + zeroes) * 4 + (size_t)images * B);
+	put_int(&record[0], JOURNAL_MAGIC);
+	put_int(&record[4], images);
+	put_int(&record[8], revokes);
+	put_int(&record[12], zeroes);
+	memcpy(&record[16], &seq, sizeof(seq));
+
+	char* numbers = &record[RECORD_HEADER];
+	char* image = numbers + ((size_t)images + revokes + zeroes) * 4;
+	for (size_t k = 0; k < batchBlocks.size(); k++)
+	{
+		if (batchBlocks[k] == -1)
+			continue;
+		put_int(numbers, batchBlocks[k]);
+		numbers += 4;
+		memcpy(image, &batchImages[k * B], B);
+		image += B;
+		loggedBlocks[batchBlocks[k]] = seq;
+	}
+	for (int r = 0; r < revokes; r++)
+	{
+		put_int(numbers, batchRevokes[r]);
+		numbers += 4;
+	}
+	for (int z = 0; z < zeroes; z++)
+	{
+		put_int(numbers, batchZeroes[z]);
+		numbers += 4;
+	}
+
+	// taken with the checksum field still zero
+	uint64_t sum = fnv1a(&record[0], record.size());
+	memcpy(&record[24], &sum, sizeof(sum));
+
+	batchBlocks.clear();
+	batchImages.clear();
+	batchSlot.clear();
+	batchRevokes.clear();
+	batchZeroes.clear();
+
+	lock_guard<mutex> guard(journalQueueLock);
+	journalQueue.push_back(vector<char>());
+	journalQueue.back().swap(record);
+	return seq;
+}
+
+//done
+bool FileSystem53::journal_write(uint64_t seq)
+{
+#if defined(FS53_MMAP_IMAGE)
+	lock_guard<mutex> guard(journalLock);
+	if (journalDurable >= seq)
+		return true;
+
+	// whatever was sealed by now goes out in one append, for every thread waiting here
+	deque<vector<char> > records;
+	{
+		lock_guard<mutex> queueGuard(journalQueueLock);
+		records.swap(journalQueue);
+	}
+	if (records.empty())
+		return false;
+
+	vector<char> append;
+	for (size_t k = 0; k < records.size(); k++)
+		append.insert(append.end(), records[k].begin(), records[k].end());
+	uint64_t last;
+	memcpy(&last, &records.back()[16], sizeof(last));
+
+	// a failed append is never counted as durable; replay stops at the gap it leaves
+	if (pwrite(journalFd, &append[0], append.size(), (off_t)journalEnd) != (ssize_t)append.size() || sync_file(journalFd) != 0)
+		return false;
+	journalEnd += (int64_t)append.size();
+	journalDurable = last;
+	return last >= seq;
+#else
+	(void)seq;
+	return false;
+#endif
+}
+
+//done
+void FileSystem53::journal_forget(int i)
+{
+	journalTouched.erase(i);
+
+	unordered_map<int, int>::iterator slot = batchSlot.find(i);
+	if (slot != batchSlot.end())
+	{
+		batchBlocks[slot->second] = -1;
+		batchSlot.erase(slot);
+	}
+
+	unordered_map<int, uint64_t>::iterator logged = loggedBlocks.find(i);
+	if (logged != loggedBlocks.end())
+	{
+		batchRevokes.push_back(i);
+		loggedBlocks.erase(logged);
+	}
+}
+
+//done
+void FileSystem53::release_freed_blocks()
+{
+	if (!blocksFreed.load() || !blocksFreed.exchange(false))
+		return;
+
+	int wordsPerBlock = B / (int)sizeof(uint64_t);
+	for (int b = 0; b < bitmapBlocks; b++)
+	{
+		if (!bitmapBlockFreed[b].exchange(false))
+			continue;
+
+		int last = (b + 1) * wordsPerBlock;
+		if (last > bitmapWordCount)
+			last = bitmapWordCount;
+		for (int word = b * wordsPerBlock; word < last; word++)
+		{
+			uint64_t freed = freedWords[word].exchange(0);
+			if (freed == 0)
+				continue;
+			if (journalFd >= 0)
+			{
+				for (uint64_t left = freed; left != 0; left &= left - 1)
+					journal_forget(word * 64 + count_trailing_zeros(left));
+			}
+			bitmapWords[word].fetch_and(~freed);
+			bitmap_word_changed(word);
+		}
+	}
+}
+
+#if defined(FS53_MMAP_IMAGE)
+//done
+void FileSystem53::start_journal()
+{
+	// without a journal the disk is only as consistent as the last save()
+	int fd = ::open(JOURNAL_IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+
+	char header[JOURNAL_HEADER];
+	memset(header, 0, sizeof(header));
+	put_int(header, JOURNAL_MAGIC);
+	put_int(header + 4, B);
+	put_int(header + 8, blockCount);
+	if (pwrite(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) || sync_file(fd) != 0)
+	{
+		::close(fd);
+		return;
+	}
+
+	journalTouched.clear();
+	batchBlocks.clear();
+	batchImages.clear();
+	batchSlot.clear();
+	batchRevokes.clear();
+	batchZeroes.clear();
+	loggedBlocks.clear();
+	for (int b = 0; b < bitmapBlocks; b++)
+		bitmapBlockUnlogged[b] = false;
+	bitmapUnlogged = false;
+	journalSeq = 0;
+	journalDurable = 0;
+	journalEnd = JOURNAL_HEADER;
+	journalStop = false;
+	journalFd = fd;
+	journalThread = thread(&FileSystem53::journal_committer, this);
+}
+
+//done
+void FileSystem53::stop_journal()
+{
+	if (journalFd < 0)
+		return;
+
+	{
+		lock_guard<mutex> guard(journalQueueLock);
+		journalStop = true;
+	}
+	journalWake.notify_all();
+	journalThread.join();
+
+	// the batch goes with the unsaved working copy
+	if (ftruncate(journalFd, 0) == 0)
+		sync_file(journalFd);
+	::close(journalFd);
+	journalFd = -1;
+	journalQueue.clear();
+}
+
+//done
+void FileSystem53::journal_committer()
+{
+	unique_lock<mutex> guard(journalQueueLock);
+	while (!journalStop)
+	{
+		journalWake.wait_for(guard, chrono::milliseconds((int64_t)JOURNAL_COMMIT_MS));
+		if (journalStop)
+			break;
+		guard.unlock();
+
+		commit();
+		bool full;
+		{
+			lock_guard<mutex> logGuard(journalLock);
+			full = (journalEnd > JOURNAL_CHECKPOINT_BYTES);
+		}
+		if (full)
+			journal_checkpoint();
+
+		guard.lock();
+	}
+}
+
+//done
+void FileSystem53::journal_checkpoint()
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	sync();
+	if (write_dirty())
+		journal_reset();
+}
+
+//done
+void FileSystem53::journal_reset()
+{
+	if (journalFd < 0)
+		return;
+
+	// the caller holds metaLock and has written the dirty blocks, so DISK_IMAGE has every sealed record
+	lock_guard<mutex> guard(journalLock);
+	char header[JOURNAL_HEADER];
+	memset(header, 0, sizeof(header));
+	put_int(header, JOURNAL_MAGIC);
+	put_int(header + 4, B);
+	put_int(header + 8, blockCount);
+	uint64_t checkpoint = journalSeq;
+	memcpy(header + 16, &checkpoint, sizeof(checkpoint));
+
+	if (ftruncate(journalFd, JOURNAL_HEADER) == 0 && pwrite(journalFd, header, sizeof(header), 0) == (ssize_t)sizeof(header))
+		sync_file(journalFd);
+	journalEnd = JOURNAL_HEADER;
+	loggedBlocks.clear();
+}
+
+//done
+void FileSystem53::journal_replay()
+{
+	int fd = ::open(JOURNAL_IMAGE, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	vector<char> log;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size >= JOURNAL_HEADER)
+	{
+		log.resize((size_t)st.st_size);
+		if (pread(fd, &log[0], log.size(), 0) != (ssize_t)log.size())
+			log.clear();
+	}
+	::close(fd);
+
+	// the log may belong to another disk geometry
+	if (log.size() < (size_t)JOURNAL_HEADER || get_int(&log[0]) != JOURNAL_MAGIC
+		|| get_int(&log[4]) != B || get_int(&log[8]) != blockCount)
+		return;
+	uint64_t checkpoint;
+	memcpy(&checkpoint, &log[16], sizeof(checkpoint));
+
+	// records follow one another up to the first torn or damaged one
+	vector<size_t> records;
+	unordered_map<int, uint64_t> revokedAt;
+	size_t pos = JOURNAL_HEADER;
+	for (uint64_t expected = checkpoint + 1; pos + RECORD_HEADER <= log.size(); expected++)
+	{
+		char* record = &log[pos];
+		int images = get_int(record + 4);
+		int revokes = get_int(record + 8);
+		int zeroes = get_int(record + 12);
+		uint64_t seq;
+		uint64_t sum;
+		memcpy(&seq, record + 16, sizeof(seq));
+		memcpy(&sum, record + 24, sizeof(sum));
+		if (get_int(record) != JOURNAL_MAGIC || images < 0 || revokes < 0 || zeroes < 0 || seq != expected)
+			break;
+
+		size_t length = RECORD_HEADER + ((size_t)images + revokes + zeroes) * 4 + (size_t)images * B;
+		if (length > log.size() - pos)
+			break;
+		memset(record + 24, 0, sizeof(sum));
+		if (fnv1a(record, length) != sum)
+			break;
+
+		for (int r = 0; r < revokes; r++)
+			revokedAt[get_int(record + RECORD_HEADER + ((size_t)images + r) * 4)] = seq;
+		records.push_back(pos);
+		pos += length;
+	}
+
+	// a revoke cancels the images of its block in earlier records; a record's zeroed blocks come before its images
+	for (size_t k = 0; k < records.size(); k++)
+	{
+		const char* record = &log[records[k]];
+		int images = get_int(record + 4);
+		int revokes = get_int(record + 8);
+		int zeroes = get_int(record + 12);
+		uint64_t seq;
+		memcpy(&seq, record + 16, sizeof(seq));
+		const char* image = record + RECORD_HEADER + ((size_t)images + revokes + zeroes) * 4;
+
+		for (int z = 0; z < zeroes; z++)
+		{
+			int no = get_int(record + RECORD_HEADER + ((size_t)images + revokes + z) * 4);
+			if (no < dataStart || no >= blockCount)
+				continue;
+			memset(device_block(no), 0, B);
+			mark_dirty(no);
+		}
+
+		for (int n = 0; n < images; n++, image += B)
+		{
+			int no = get_int(record + RECORD_HEADER + (size_t)n * 4);
+			if (no < 0 || no >= blockCount)
+				continue;
+			unordered_map<int, uint64_t>::const_iterator revoked = revokedAt.find(no);
+			if (revoked != revokedAt.end() && revoked->second > seq)
+				continue;
+			memcpy(device_block(no), image, B);
+			mark_dirty(no);
+		}
+	}
+	write_dirty();
+}
+#endif
+
+//done
+void FileSystem53::diskdump(int start, int size)
+{
+	static const char hexDigits[] = "0123456789abcdef";
+
+	if (start < 0)
+	{
+		size += start;
+		start = 0;
+	}
+	if (size > blockCount - start)
+		size = blockCount - start;
+
+	// one linear pass over the contiguous image, 16 bytes per line
+	lock_guard<MetaMutex> guard(metaLock);
+	sync();
+	for (int i = start; i < start + size; i++)
+	{
+		const char* data = device_block(i);
+		cout << "Block " << i << ":" << endl;
+
+		for (int line = 0; line < B; line += 16)
+		{
+			string text = "  ";
+			for (int j = line; j < line + 16 && j < B; j++)
+			{
+				unsigned char c = (unsigned char)data[j];
+				text += hexDigits[c >> 4];
+				text += hexDigits[c & 15];
+				text += ' ';
+			}
+			text += " |";
+			for (int j = line; j < line + 16 && j < B; j++)
+				text += (data[j] >= 32 && data[j] < 127) ? data[j] : '.';
+			text += '|';
+			cout << text << endl;
+		}
+	}
+}
+
+//done
+uint64_t FileSystem53::checksum()
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	sync();
+
+	// B is a multiple of 8, so the image is a whole number of words
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t offset = 0; offset < diskBytes; offset += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, ldisk + offset, sizeof(word));
+		hash ^= word;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+//done
+FileSystem53::~FileSystem53()
+{
+	release();
+}
+
+//done
+void FileSystem53::print()
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	for (int i = 0; i < blockCount; i++)
+	{
+		if (i == 0)
+		{
+			cout << "Superblock: block size " << B << ", " << blockCount << " blocks, " << descriptorCount
+				<< " descriptors, " << maxOpenFiles << " open files, name length " << nameLength << endl;
+			continue;
+		}
+		else if (i < descStart)
+		{
+			cout << "Bitmap: ";
+			for (int j = (i - bitmapStart) * B * 8; j < (i - bitmapStart + 1) * B * 8 && j < blockCount; j++)
+				cout << (((bitmapWords[j / 64].load() >> (j % 64)) & 1) ? '1' : '0');
+			cout << endl;
+			continue;
+		}
+		else if (i < dataStart)
+		{
+			cout << "File Descriptors: ";
+		}
+		else
+			cout << "Block " << i << ": ";
+
+		cout.write(block(i), B);
+		cout << endl;
+	}
+
+	cout << endl << "OFTABLE" << endl;
+	lock_guard<mutex> tableGuard(tableLock);
+	for (size_t k = 0; k < OFTable.size(); k++)
+	{
+		const OpenFile& file = *OFTable[k];
+		if (file.refCount == 0)
+			continue;
+
+		cout << "Contents of OFTable " << endl;
+		cout.write(file.buffer, B);
+		cout << endl << " Current Position: " << file.position << endl;
+		cout << " File length: " << file.active->size << endl;
+		cout << endl;
+	}
+}
+
+//done
+FileSystem53::DirectoryIndex& FileSystem53::directory_index(int dir)
+{
+	unordered_map<int, DirectoryIndex>::iterator cached = dentryCache.find(dir);
+	if (cached != dentryCache.end())
+		return cached->second;
+
+	DirectoryIndex& index = dentryCache[dir];
+	int perBlock = entries_per_block();
+	index.slotCount = 0;
+
+	for (int i = 0; ; i++)
+	{
+		int blockNo = map_block(dir, i, false);
+		if (blockNo <= 0)
+			break;
+
+		const char* directoryFile = block(blockNo);
+		for (int j = 0; j < perBlock; j++)
+		{
+			const char* entry = directoryFile + j * dirEntrySize;
+			if (entry[0] == '\0')
+			{
+				index.freeSlots.push(index.slotCount + j);
+				continue;
+			}
+
+			int desc = get_int(entry + nameLength);
+			DirectoryEntry found = { index.slotCount + j, desc & ~DIR_FLAG, (desc & DIR_FLAG) != 0 };
+			index.entries[string(entry, strnlen(entry, nameLength))] = found;
+		}
+		index.slotCount += perBlock;
+	}
+
+	return index;
+}
+
+//done
+const FileSystem53::DirectoryEntry* FileSystem53::find_entry(int dir, const string& name)
+{
+	DirectoryIndex& index = directory_index(dir);
+
+	unordered_map<string, DirectoryEntry>::const_iterator it = index.entries.find(name);
+	return (it == index.entries.end()) ? NULL : &it->second;
+}
+
+//done
+int FileSystem53::resolve_parent(const string& path, int& parent, string& leaf)
+{
+	parent = 0;
+	leaf.clear();
+
+	size_t start = 0;
+	while (start <= path.length())
+	{
+		size_t end = path.find('/', start);
+		if (end == string::npos)
+			end = path.length();
+
+		string component = path.substr(start, end - start);
+		start = end + 1;
+		if (component.empty())
+			continue;
+
+		// the previous component has to be a directory
+		if (!leaf.empty())
+		{
+			const DirectoryEntry* entry = find_entry(parent, leaf);
+			if (entry == NULL || !entry->isDir)
+				return -1;
+			parent = entry->desc;
+		}
+		leaf = component;
+	}
+
+	return 0;
+}
+
+//done
+int FileSystem53::resolve_directory(const string& path)
+{
+	int parent;
+	string leaf;
+	if (resolve_parent(path, parent, leaf) == -1)
+		return -1;
+
+	// "" and "/" name the root
+	if (leaf.empty())
+		return parent;
+
+	const DirectoryEntry* entry = find_entry(parent, leaf);
+	return (entry != NULL && entry->isDir) ? entry->desc : -1;
+}
+
+//done
+int FileSystem53::add_entry(int dir, const string& name, int desc, bool isDir)
+{
+	DirectoryIndex& index = directory_index(dir);
+
+	// take the lowest free slot, or give the directory one more block
+	int slot;
+	if (!index.freeSlots.empty())
+	{
+		slot = index.freeSlots.top();
+		index.freeSlots.pop();
+	}
+	else
+	{
+		int perBlock = entries_per_block();
+		int directoryBlock = map_block(dir, index.slotCount / perBlock, true);
+		if (directoryBlock == -1)
+			return -1;
+
+		write_block(directoryBlock, zeroBlock);
+		slot = index.slotCount;
+		for (int j = 1; j < perBlock; j++)
+			index.freeSlots.push(slot + j);
+		index.slotCount += perBlock;
+	}
+
+	//add the name + descriptor number to the directory
+	char* entry = block_for_write(entry_block(dir, slot)) + entry_offset(slot);
+	for (int n = 0; n < nameLength; n++)
+		entry[n] = (n < (int)name.length()) ? name[n] : '\0';
+	put_int(entry + nameLength, isDir ? (desc | DIR_FLAG) : desc);
+
+	DirectoryEntry added = { slot, desc, isDir };
+	index.entries[name] = added;
+
+	// the directory's size field counts its entries
+	char dirDescriptor[DESCR_SIZE];
+	read_descriptor(dir, dirDescriptor);
+	put_int(dirDescriptor, get_int(dirDescriptor) + 1);
+	write_descriptor(dir, dirDescriptor);
+
+	return 0;
+}
+
+//done
+void FileSystem53::remove_entry(int dir, const string& name)
+{
+	DirectoryIndex& index = directory_index(dir);
+	unordered_map<string, DirectoryEntry>::iterator it = index.entries.find(name);
+	if (it == index.entries.end())
+		return;
+
+	int slot = it->second.slot;
+	memset(block_for_write(entry_block(dir, slot)) + entry_offset(slot), '\0', dirEntrySize);
+	index.entries.erase(it);
+	index.freeSlots.push(slot);
+
+	char dirDescriptor[DESCR_SIZE];
+	read_descriptor(dir, dirDescriptor);
+	put_int(dirDescriptor, get_int(dirDescriptor) - 1);
+	write_descriptor(dir, dirDescriptor);
+}
+
+//done
+int FileSystem53::create_node(const string& path, bool isDir)
+{
+	int parent;
+	string leaf;
+	if (resolve_parent(path, parent, leaf) == -1)
+		return -1;
+	if (leaf.empty() || leaf.length() > (size_t)nameLength)
+		return -1;
+
+	// the name already exists
+	if (find_entry(parent, leaf) != NULL)
+		return -2;
+
+	int fileDescriptorIndex = find_empty_descriptor();
+
+	// out of space
+	if (fileDescriptorIndex == -1)
+		return -1;
+
+	// the new file gets its first block straight away; for a directory it is the first block of entries
+	int firstBlock = allocate_block();
+	if (firstBlock == -1)
+		return -1;
+
+	if (add_entry(parent, leaf, fileDescriptorIndex, isDir) == -1)
+	{
+		free_block(firstBlock);
+		return -1;
+	}
+
+	write_block(firstBlock, zeroBlock);
+
+	char fileDescriptor[DESCR_SIZE];
+	memset(fileDescriptor, 0, DESCR_SIZE);
+	put_int(fileDescriptor + FILE_SIZE_FIELD, firstBlock);
+	write_descriptor(fileDescriptorIndex, fileDescriptor);
+
+	return 0;
+}
+
+//done
+int FileSystem53::create(string symbolic_file_name)
+{
+	OpTimer timer(this, STAT_CREATE);
+	lock_guard<MetaMutex> guard(metaLock);
+	return create_node(symbolic_file_name, false);
+}
+
+//done
+int FileSystem53::mkdir(string path)
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	return create_node(path, true);
+}
+
+//done
+int FileSystem53::deleteFile(string symbolic_file_name)
+{
+	OpTimer timer(this, STAT_DELETE);
+	lock_guard<MetaMutex> guard(metaLock);
+	int parent;
+	string leaf;
+	if (resolve_parent(symbolic_file_name, parent, leaf) == -1)
+		return -1;
+
+	const DirectoryEntry* entry = find_entry(parent, leaf);
+	if (entry == NULL || entry->isDir)
+		return -1;
+
+	// an open file keeps its blocks; opening also holds metaLock, so this cannot race with it
+	int indexOfFileDescriptor = entry->desc;
+	{
+		lock_guard<mutex> tableGuard(tableLock);
+		if (activeFiles.count(indexOfFileDescriptor) != 0)
+			return -1;
+	}
+
+	// release the file's blocks with the descriptor
+	remove_entry(parent, leaf);
+	clear_descriptor(indexOfFileDescriptor);
+
+	return 0;
+}
+
+//done
+int FileSystem53::rmdir(string path)
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	int parent;
+	string leaf;
+	if (resolve_parent(path, parent, leaf) == -1)
+		return -1;
+
+	const DirectoryEntry* entry = find_entry(parent, leaf);
+	if (entry == NULL || !entry->isDir)
+		return -1;
+
+	int dir = entry->desc;
+	if (file_size(dir) != 0)
+		return -2;
+
+	remove_entry(parent, leaf);
+	clear_descriptor(dir);
+	dentryCache.erase(dir);
+
+	return 0;
+}
+
+//done
+void FileSystem53::OpenFileTable()
+{
+	// the table starts with open_files entries and grows from there; whatever was open is dropped unflushed
+	freeOft.clear();
+	for (size_t i = 0; i < OFTable.size(); i++)
+	{
+		drop_readahead(*OFTable[i]);
+		clear_oft(*OFTable[i]);
+	}
+	while (OFTable.size() < (size_t)maxOpenFiles)
+	{
+		OpenFile* entry = new OpenFile();
+		entry->block = -1;
+		entry->index = (int)OFTable.size();
+		OFTable.push_back(entry);
+	}
+	for (size_t i = OFTable.size(); i > 0; i--)
+		freeOft.push_back((int)i - 1);
+	activeFiles.clear();
+
+	for (size_t i = 0; i < processes.size(); i++)
+		delete processes[i];
+	processes.clear();
+	freePids.clear();
+	create_process();
+	mainProcess = processes[0];
+
+	// every thread drops back to process 0
+	processGeneration = nextGeneration++;
+	boundProcess.generation = processGeneration;
+	boundProcess.process = mainProcess;
+}
+
+//done
+int FileSystem53::open(string symbolic_file_name)
+{
+	OpTimer timer(this, STAT_OPEN);
+	lock_guard<MetaMutex> guard(metaLock);
+	int parent;
+	string leaf;
+	if (resolve_parent(symbolic_file_name, parent, leaf) == -1)
+		return -1;
+
+	const DirectoryEntry* entry = find_entry(parent, leaf);
+	if (entry == NULL || entry->isDir)
+		return -1;
+	int fileDescriptorNum = entry->desc;
+
+	int freeoft = open_desc(fileDescriptorNum);
+	if (freeoft == -1)
+		return -2;
+	return freeoft;
+}
+
+//done
+int FileSystem53::open_desc(int desc_no)
+{
+	if (desc_no < 0 || desc_no >= descriptorCount)
+		return -1;
+
+	// held until the handle exists, so deleteFile() sees the file as open
+	lock_guard<MetaMutex> guard(metaLock);
+	int freeoft = find_oft();
+	OpenFile& file = *OFTable[freeoft];
+	char fileDescriptor[DESCR_SIZE];
+	read_descriptor(desc_no, fileDescriptor);
+
+	{
+		lock_guard<mutex> tableGuard(tableLock);
+
+		// the size is read once, by the first open, and only written back on flush/close.
+		// A new ActiveFile is value-initialized, so its openCount starts at 0.
+		ActiveFile& active = activeFiles[desc_no];
+		if (active.openCount == 0)
+		{
+			active.size = get_int(fileDescriptor);
+			active.sizeDirty = false;
+		}
+		active.openCount++;
+
+		// has free oft
+		file.refCount = 1;
+		file.descriptor = desc_no;
+		file.position = 0;
+		file.block = -1;
+		file.active = &active;
+		file.dirty = false;
+		file.streak = 0;
+		file.knownSize = 0;
+	}
+
+	// no other thread can reach the entry yet
+	load_oft_block(file, 0);
+
+	// lowest-cost free handle: the most recently closed one
+	Process& process = *current_process();
+	lock_guard<mutex> processGuard(process.lock);
+	int handle;
+	if (!process.freeHandles.empty())
+	{
+		handle = process.freeHandles.back();
+		process.freeHandles.pop_back();
+		process.handles[handle] = &file;
+	}
+	else
+	{
+		handle = (int)process.handles.size();
+		process.handles.push_back(&file);
+	}
+
+	return handle;
+}
+
+//done
+int FileSystem53::find_oft()
+{
+	lock_guard<mutex> guard(tableLock);
+	if (freeOft.empty())
+	{
+		OpenFile* entry = new OpenFile();
+		entry->block = -1;
+		entry->index = (int)OFTable.size();
+		OFTable.push_back(entry);
+		freeOft.push_back(entry->index);
+	}
+
+	int index = freeOft.back();
+	freeOft.pop_back();
+	if (OFTable[index]->buffer == NULL)
+		OFTable[index]->buffer = new char[B];
+	return index;
+}
+
+//done
+void FileSystem53::deallocate_oft(int index)
+{
+	lock_guard<mutex> guard(tableLock);
+	OpenFile& file = *OFTable[index];
+
+	unordered_map<int, ActiveFile>::iterator active = activeFiles.find(file.descriptor);
+	if (active != activeFiles.end() && --active->second.openCount == 0)
+		activeFiles.erase(active);
+
+	clear_oft(file);
+	freeOft.push_back(index);
+}
+
+//done
+void FileSystem53::clear_oft(OpenFile& file)
+{
+	file.position = 0;
+	file.descriptor = 0;
+	file.block = -1;
+	file.refCount = 0;
+	file.active = NULL;
+	file.dirty = false;
+	file.streak = 0;
+	file.knownSize = 0;
+}
+
+//done
+FileSystem53::Process* FileSystem53::current_process()
+{
+	return (boundProcess.generation == processGeneration) ? boundProcess.process : mainProcess;
+}
+
+//done
+FileSystem53::OpenFile* FileSystem53::oft_entry(int index)
+{
+	Process& process = *current_process();
+	lock_guard<mutex> guard(process.lock);
+	if (index < 0 || index >= (int)process.handles.size())
+		return NULL;
+	return process.handles[index];
+}
+
+//done
+void FileSystem53::release_oft(OpenFile* file)
+{
+	{
+		lock_guard<mutex> guard(tableLock);
+		if (--file->refCount > 0)
+			return;
+	}
+
+	// the last reference is gone, nobody else can reach the entry
+	{
+		lock_guard<mutex> entryGuard(file->lock);
+		lock_guard<RwLock> fileGuard(file->active->lock);
+		flush_oft(*file);
+		drop_readahead(*file);
+	}
+	deallocate_oft(file->index);
+}
+
+//done
+int FileSystem53::new_process()
+{
+	int pid;
+	if (!freePids.empty())
+	{
+		pid = freePids.back();
+		freePids.pop_back();
+	}
+	else
+	{
+		pid = (int)processes.size();
+		processes.push_back(new Process());
+	}
+	processes[pid]->alive = true;
+	return pid;
+}
+
+//done
+int FileSystem53::create_process()
+{
+	lock_guard<mutex> guard(tableLock);
+	return new_process();
+}
+
+//done
+int FileSystem53::fork_process()
+{
+	Process& parent = *current_process();
+	lock_guard<mutex> parentGuard(parent.lock);
+	lock_guard<mutex> guard(tableLock);
+	if (!parent.alive)
+		return -1;
+
+	int pid = new_process();
+	Process* child = processes[pid];
+	child->handles = parent.handles;
+	child->freeHandles = parent.freeHandles;
+	for (size_t i = 0; i < child->handles.size(); i++)
+	{
+		if (child->handles[i] != NULL)
+			child->handles[i]->refCount++;
+	}
+	return pid;
+}
+
+//done
+int FileSystem53::switch_process(int pid)
+{
+	lock_guard<mutex> guard(tableLock);
+	if (pid < 0 || pid >= (int)processes.size() || !processes[pid]->alive)
+		return -1;
+
+	boundProcess.generation = processGeneration;
+	boundProcess.process = processes[pid];
+	return 0;
+}
+
+//done
+int FileSystem53::exit_process(int pid)
+{
+	Process* process;
+	{
+		lock_guard<mutex> guard(tableLock);
+		if (pid < 0 || pid >= (int)processes.size() || !processes[pid]->alive)
+			return -1;
+		process = processes[pid];
+		process->alive = false;
+	}
+
+	// the entries are released outside the process lock, which ranks below the entry locks
+	vector<OpenFile*> handles;
+	{
+		lock_guard<mutex> guard(process->lock);
+		handles.swap(process->handles);
+		process->freeHandles.clear();
+	}
+	for (size_t i = 0; i < handles.size(); i++)
+	{
+		if (handles[i] != NULL)
+			release_oft(handles[i]);
+	}
+
+	// process 0 stays the one threads start out in
+	if (pid != 0)
+	{
+		lock_guard<mutex> guard(tableLock);
+		freePids.push_back(pid);
+	}
+	return 0;
+}
+
+//done
+int FileSystem53::dup(int index)
+{
+	Process& process = *current_process();
+	lock_guard<mutex> guard(process.lock);
+	if (index < 0 || index >= (int)process.handles.size() || process.handles[index] == NULL)
+		return -1;
+
+	OpenFile* file = process.handles[index];
+	{
+		lock_guard<mutex> tableGuard(tableLock);
+		file->refCount++;
+	}
+
+	int handle;
+	if (!process.freeHandles.empty())
+	{
+		handle = process.freeHandles.back();
+		process.freeHandles.pop_back();
+		process.handles[handle] = file;
+	}
+	else
+	{
+		handle = (int)process.handles.size();
+		process.handles.push_back(file);
+	}
+	return handle;
+}
+
+//done
+int FileSystem53::open_handles()
+{
+	Process& process = *current_process();
+	lock_guard<mutex> guard(process.lock);
+	return (int)(process.handles.size() - process.freeHandles.size());
+}
+
+//done
+void FileSystem53::load_oft_block(OpenFile& file, int blockNumber, bool overwrite)
+{
+	if (file.block == blockNumber)
+		return;
+
+	// the entry moves on, so its old block can be written while it works on the next
+	write_back(file, true);
+
+	count_stat(COUNT_OFT_RELOADS);
+	file.streak = (file.block != -1 && blockNumber == file.block + 1) ? file.streak + 1 : 0;
+	file.block = blockNumber;
+	if (overwrite)
+		return;
+
+	fetch_block(file, blockNumber, file.buffer);
+}
+
+//done
+void FileSystem53::write_back(OpenFile& file, bool behind)
+{
+	if (file.block == -1 || !file.dirty)
+		return;
+
+	int blockNo = map_block(file.descriptor, file.block, false);
+	if (blockNo > 0)
+	{
+		char* spare = (behind && imageFd >= 0) ? write_behind(blockNo, file.buffer) : NULL;
+		if (spare != NULL)
+		{
+			file.buffer = spare;
+			count_stat(COUNT_DATA_WRITES);
+		}
+		else
+			write_block(blockNo, file.buffer);
+
+		// read-ahead of the file from before this point is stale
+		file.active->version++;
+	}
+	file.dirty = false;
+}
+
+//done
+void FileSystem53::fetch_block(OpenFile& file, int blockNumber, char* dst)
+{
+	if (take_readahead(file, blockNumber, dst))
+		return;
+
+	// an unallocated block reads as zeros
+	int blockNo = map_block(file.descriptor, blockNumber, false);
+	if (blockNo > 0)
+		read_block(blockNo, dst);
+	else
+		memset(dst, '\0', B);
+
+	// the entry reads sequentially and the windows are behind it: start over just after this block
+	if (file.streak >= READAHEAD_TRIGGER && imageFd >= 0)
+		start_readahead(file, 0, blockNumber + 1);
+}
+
+//done
+bool FileSystem53::take_readahead(OpenFile& file, int blockNumber, char* dst)
+{
+	for (int w = 0; w < 2; w++)
+	{
+		Readahead* window = file.ahead[w];
+		if (window == NULL || blockNumber < window->first || blockNumber >= window->first + window->count)
+			continue;
+
+		wait_batch(window->batch);
+		if (window->batch.failed || window->version != file.active->version)
+		{
+			window->count = 0;
+			return false;
+		}
+		memcpy(dst, window->data + (size_t)(blockNumber - window->first) * B, B);
+
+		// entering a window starts the other one on the blocks after it
+		if (blockNumber == window->first)
+			start_readahead(file, 1 - w, window->first + window->count);
+		return true;
+	}
+	return false;
+}
+
+//done
+void FileSystem53::start_readahead(OpenFile& file, int w, int firstBlock)
+{
+	Readahead*& window = file.ahead[w];
+	if (window == NULL)
+	{
+		window = new Readahead();
+		window->data = new char[(size_t)READAHEAD_BLOCKS * B];
+	}
+	else
+		wait_batch(window->batch);
+
+	// nothing past end of file
+	int endBlock = (file.active->size + B - 1) / B;
+	int count = endBlock - firstBlock;
+	if (count > READAHEAD_BLOCKS)
+		count = READAHEAD_BLOCKS;
+	window->first = firstBlock;
+	window->count = (count > 0) ? count : 0;
+	window->version = file.active->version;
+	window->batch.pending = window->count;
+	window->batch.failed = false;
+
+	Readahead* target = window;
+	int blockSize = B;
+	IoCallback done = [target, blockSize](int n)
+	{
+		lock_guard<mutex> guard(target->batch.lock);
+		if (n != blockSize)
+			target->batch.failed = true;
+		if (--target->batch.pending == 0)
+			target->batch.done.notify_all();
+	};
+
+	for (int k = 0; k < window->count; k++)
+	{
+		char* dst = window->data + (size_t)k * B;
+		int blockNo = map_block(file.descriptor, firstBlock + k, false);
+		if (blockNo > 0)
+			read_block_async(blockNo, dst, done);
+		else
+		{
+			memset(dst, '\0', B);
+			done(B);
+		}
+	}
+}
+
+//done
+void FileSystem53::drop_readahead(OpenFile& file)
+{
+	for (int w = 0; w < 2; w++)
+	{
+		if (file.ahead[w] == NULL)
+			continue;
+		wait_batch(file.ahead[w]->batch);
+		delete[] file.ahead[w]->data;
+		delete file.ahead[w];
+		file.ahead[w] = NULL;
+	}
+}
+
+//done
+int FileSystem53::file_size(int desc_no)
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	{
+		lock_guard<mutex> tableGuard(tableLock);
+		unordered_map<int, ActiveFile>::const_iterator active = activeFiles.find(desc_no);
+		if (active != activeFiles.end())
+			return active->second.size;
+	}
+
+	char fileDescriptor[DESCR_SIZE];
+	return get_int(read_descriptor(desc_no, fileDescriptor));
+}
+
+//done
+void FileSystem53::directory()
+{
+	directory("");
+}
+
+//done
+int FileSystem53::directory(string path)
+{
+	vector<DirEntry> entries;
+	if (list(path, entries, LIST_SIZES) == -1)
+		return -1;
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (i > 0)
+			cout << ", ";
+		cout << entries[i].name;
+		if (entries[i].directory)
+			cout << "/";
+		else
+			cout << " " << entries[i].size << " bytes";
+	}
+
+	return 0;
+}
 
-			//clear buffer
-			for (int k = 0; k < l; k++)
+//done
+int FileSystem53::list(string path, vector<DirEntry>& entries, int attributes)
+{
+	lock_guard<MetaMutex> guard(metaLock);
+	entries.clear();
+	int dir = resolve_directory(path);
+	if (dir == -1)
+		return -1;
+
+	// names first: one view of each directory block, which looking up attributes could evict
+	for (int count = 0; ; count++)
+	{
+		int temp = map_block(dir, count, false);
+		if (temp <= 0)
+			break;
+
+		const char* data = block(temp);
+		for (int i = 0; i + dirEntrySize <= B; i += dirEntrySize)
+		{
+			const char* entry = data + i;
+			if (entry[0] == '\0')
+				continue;
+
+			int length = 0;
+			while (length < nameLength && entry[length] != '\0')
+				length++;
+			int desc = get_int(entry + nameLength);
+
+			entries.push_back(DirEntry());
+			DirEntry& listed = entries.back();
+			listed.name.assign(entry, length);
+			listed.descriptor = desc & ~DIR_FLAG;
+			listed.directory = (desc & DIR_FLAG) != 0;
+			listed.size = -1;
+			listed.blocks = -1;
+		}
+	}
+
+	if (attributes & (LIST_SIZES | LIST_BLOCKS))
+	{
+		for (size_t k = 0; k < entries.size(); k++)
+		{
+			if (attributes & LIST_SIZES)
+				entries[k].size = file_size(entries[k].descriptor);
+			if (attributes & LIST_BLOCKS)
 			{
-				buffer[k] = OFTable[index][k];
-				OFTable[index][k] = '\0';
-				
+				char desc[DESCR_SIZE];
+				entries[k].blocks = count_file_blocks(read_descriptor(entries[k].descriptor, desc));
 			}
-			
-			//write buffer to ldisk
-			write_block(fileDescriptor[fileDescriptorIndex + blockNumber - 1], buffer);
-			//get new block from ldisk
-			read_block(fileDescriptor[fileDescriptorIndex + blockNumber], file);
-
-			//put new block into OFTable
-			for (int k = 0; k < l; k++)
+		}
+	}
+
+	return (int)entries.size();
+}
+
+//done
+int FileSystem53::read(int index, char* mem_area, int count)
+{
+	OpTimer timer(this, STAT_READ);
+	OpenFile* file = oft_entry(index);
+	if (file == NULL)
+		return -1;
+
+	lock_guard<mutex> entryGuard(file->lock);
+	ReadLock fileGuard(file->active->lock);
+	if (file->position >= file->active->size)
+		return -2;
+
+	return read_chunks(*file, mem_area, count);
+}
+
+//done
+int FileSystem53::readv(int index, const IoVector* vectors, int vector_count)
+{
+	OpTimer timer(this, STAT_READ);
+	OpenFile* file = oft_entry(index);
+	if (file == NULL)
+		return -1;
+
+	lock_guard<mutex> entryGuard(file->lock);
+	ReadLock fileGuard(file->active->lock);
+	const ActiveFile& active = *file->active;
+	if (file->position >= active.size)
+		return -2;
+
+	int total = 0;
+	for (int v = 0; v < vector_count && file->position < active.size; v++)
+		total += read_chunks(*file, vectors[v].mem_area, vectors[v].count);
+
+	return total;
+}
+
+//done
+int FileSystem53::read_chunks(OpenFile& file, char* mem_area, int n)
+{
+	int size = file.active->size;
+	int currentPosition = (int)file.position;
+	int actualValue = 0;
+
+	// once the disk is backed by the image file, whole blocks are read together through the I/O engine
+	vector<int> wholeBlocks;
+	vector<char*> wholeBuffers;
+
+	// stop at end of file
+	if (n > size - currentPosition)
+		n = size - currentPosition;
+
+	while (actualValue < n)
+	{
+		int blockNumber = currentPosition / B;
+		int offset = currentPosition % B;
+		int chunk = B - offset;
+		if (chunk > n - actualValue)
+			chunk = n - actualValue;
+
+		if (file.block != blockNumber && chunk == B)
+		{
+			// a whole block that is not buffered goes straight from read-ahead or ldisk to mem_area
+			if (!take_readahead(file, blockNumber, mem_area + actualValue))
 			{
-				OFTable[index][k] = file[k];
+				int blockNo = map_block(file.descriptor, blockNumber, false);
+				if (blockNo > 0 && imageFd >= 0)
+				{
+					wholeBlocks.push_back(blockNo);
+					wholeBuffers.push_back(mem_area + actualValue);
+				}
+				else if (blockNo > 0)
+					read_block(blockNo, mem_area + actualValue);
+				else
+					memset(mem_area + actualValue, '\0', B);
 			}
 		}
+		else
+		{
+			// need new file block in buffer
+			load_oft_block(file, blockNumber);
+			memcpy(mem_area + actualValue, file.buffer + offset, chunk);
+		}
+
+		currentPosition += chunk;
+		actualValue += chunk;
+	}
+
+	// a lone block, or a batch the engine failed, is read directly
+	if (wholeBlocks.size() > 1 && read_blocks(wholeBlocks, wholeBuffers) == 0)
+		wholeBlocks.clear();
+	for (size_t k = 0; k < wholeBlocks.size(); k++)
+		read_block(wholeBlocks[k], wholeBuffers[k]);
+
+	file.position = currentPosition;
+
+	return actualValue;
+}
+
+//done
+int FileSystem53::flush(int index)
+{
+	OpenFile* file = oft_entry(index);
+	if (file == NULL)
+		return -1;
+
+	lock_guard<mutex> entryGuard(file->lock);
+	lock_guard<RwLock> fileGuard(file->active->lock);
+	flush_oft(*file);
+	return 0;
+}
+
+//done
+void FileSystem53::flush_oft(OpenFile& file)
+{
+	// write the buffer back to ldisk, the entry keeps using it
+	write_back(file, false);
+
+	ActiveFile& active = *file.active;
+	if (active.sizeDirty)
+	{
+		lock_guard<MetaMutex> guard(metaLock);
+		char fileDescriptor[DESCR_SIZE];
+		read_descriptor(file.descriptor, fileDescriptor);
+		put_int(fileDescriptor, active.size);
+		write_descriptor(file.descriptor, fileDescriptor);
+		active.sizeDirty = false;
+	}
+}
+
+//done
+void FileSystem53::close(int index)
+{
+	OpTimer timer(this, STAT_CLOSE);
+	OpenFile* file;
+	{
+		Process& process = *current_process();
+		lock_guard<mutex> guard(process.lock);
+		if (index < 0 || index >= (int)process.handles.size() || process.handles[index] == NULL)
+			return;
+
+		file = process.handles[index];
+		process.handles[index] = NULL;
+		process.freeHandles.push_back(index);
+	}
+
+	release_oft(file);
+}
+
+//done
+int FileSystem53::lseek(int index, int pos)
+{
+	OpTimer timer(this, STAT_LSEEK);
+	OpenFile* file = oft_entry(index);
+	if (file == NULL)
+		return -1;
+
+	lock_guard<mutex> entryGuard(file->lock);
+	ReadLock fileGuard(file->active->lock);
+	int size = file->active->size;
+	if (pos > size)
+		pos = size;
+	if (pos < 0)
+		pos = 0;
+
+	load_oft_block(*file, pos / B);
+	file->position = pos;
+
+	return 0;
+}
+
+//done
+int FileSystem53::write(int index, char value, int count)
+{
+	if (count < 0)
+		count = 0;
+	return write_chunks(index, NULL, value, count);
+}
+
+//done
+int FileSystem53::write(int index, const char* data, size_t n)
+{
+	return write_chunks(index, data, '\0', n);
+}
 
-		//write from buffer into mem_area
-		if (OFTable[index][blockIndex] != '\0')
-		{
-			mem_area[i] = OFTable[index][blockIndex];
-			actualValue++;
-			currentPosition++;
-		}
+//done
+int FileSystem53::write_chunks(int index, const char* data, char value, size_t n)
+{
+	OpTimer timer(this, STAT_WRITE);
+	OpenFile* entry = oft_entry(index);
+	if (entry == NULL)
+		return -1;
+
+	OpenFile& file = *entry;
+	lock_guard<mutex> entryGuard(file.lock);
+	ActiveFile& active = *file.active;
+	lock_guard<RwLock> fileGuard(active.lock);
+	int currentPosition = (int)file.position;
+	size_t written = 0;
+
+	// blocks past the end of the file that this write fills are claimed in one batch
+	BlockReserve reserve;
+	reserve.next = 0;
+	long long firstNew = ((long long)active.size + B - 1) / B;
+	if (firstNew < currentPosition / B)
+		firstNew = currentPosition / B;
+	long long lastNew = ((long long)currentPosition + (long long)n - 1) / B;
+	if (lastNew >= maxFileBlocks)
+		lastNew = maxFileBlocks - 1;
+
+	// a new file already has its first block
+	while (firstNew < lastNew && map_block(file.descriptor, (int)firstNew, false) > 0)
+		firstNew++;
+	if (n > 0 && lastNew > firstNew)
+	{
+		int goal = (firstNew > 0) ? map_block(file.descriptor, (int)firstNew - 1, false) : 0;
+		reserve.blocks.resize((size_t)(lastNew - firstNew + 1));
+		reserve.blocks.resize(allocate_blocks((int)reserve.blocks.size(), &reserve.blocks[0], (goal > 0) ? goal + 1 : -1));
 	}
-	
-	int countTemp = 1;
-	int length = 0;
-	while (fileDescriptor[OFTable[index][65] + countTemp] != '\0' && countTemp < 4)
+
+	while (written < n)
 	{
-		read_block(fileDescriptor[OFTable[index][65] + countTemp], file);
-		int counter = 0;
-		while (file[counter] != '\0' && counter < 64)
-		{
-			length++;
-			counter++;
-		}
+		int blockNumber = currentPosition / B;
+		int offset = currentPosition % B;
+		int chunk = B - offset;
+		if ((size_t)chunk > n - written)
+			chunk = (int)(n - written);
+
+		// maximum file size reached
+		if (blockNumber >= maxFileBlocks)
+			break;
+
+		// a whole block past end of file is replaced outright, anything else merges with the old contents
+		bool overwrite = (chunk == B && currentPosition >= active.size);
+		load_oft_block(file, blockNumber, overwrite);
+
+		// entering a new block may need it allocated in the bitmap and file descriptor
+		if (map_block(file.descriptor, blockNumber, true, &reserve) == -1)
+			break;
+
+		if (data != NULL)
+			memcpy(file.buffer + offset, data + written, chunk);
+		else
+			memset(file.buffer + offset, value, chunk);
+		file.dirty = true;
 
-		countTemp++;
+		currentPosition += chunk;
+		written += chunk;
 	}
 
-	fileDescriptor[OFTable[index][65]] = length;
-	write_block(1, fileDescriptor);
+	file.position = currentPosition;
 
-	OFTable[index][64] = currentPosition;
+	// hand back blocks the write did not get to use
+	for (size_t i = reserve.next; i < reserve.blocks.size(); i++)
+		free_block(reserve.blocks[i]);
 
-	if (currentPosition == fileSize)
+	// the file grew: keep the new size in memory until flush/close
+	if (currentPosition > active.size)
 	{
-		delete fileDescriptor;
-		delete file;
-		delete buffer;
+		active.size = currentPosition;
+		active.sizeDirty = true;
+	}
 
+	if (written == 0 && n > 0)
 		return -2;
+	return (int)written;
+}
+
+//done
+int FileSystem53::fgetc_slow(OpenFile& file)
+{
+	ReadLock fileGuard(file.active->lock);
+	file.knownSize = file.active->size;
+	if (file.position >= file.knownSize)
+		return EOF;
+
+	char c;
+	read_chunks(file, &c, 1);
+	return (unsigned char)c;
+}
+
+//done
+int FileSystem53::fputc_slow(OpenFile& file, int index, char value)
+{
+	{
+		lock_guard<mutex> entryGuard(file.lock);
+
+		// appending to the buffered block only grows the size; the blocks below the end of file are all mapped
+		ActiveFile& active = *file.active;
+		lock_guard<RwLock> fileGuard(active.lock);
+		int blockNumber = (int)(file.position / B);
+		if (file.block == blockNumber && (int64_t)blockNumber * B < active.size)
+		{
+			file.buffer[file.position++ % B] = value;
+			file.dirty = true;
+			if (file.position > active.size)
+			{
+				active.size = (int)file.position;
+				active.sizeDirty = true;
+			}
+			file.knownSize = active.size;
+			return (unsigned char)value;
+		}
 	}
 
-	delete fileDescriptor;
-	delete file;
-	delete buffer;
+	if (write_chunks(index, &value, '\0', 1) != 1)
+		return -2;
+	return (unsigned char)value;
+}
+
+//done
+bool FileSystem53::feof(int index)
+{
+	OpenFile* file = oft_entry(index);
+	if (file == NULL)
+		return true;
 
-	return actualValue;
+	lock_guard<mutex> entryGuard(file->lock);
+	if (file->position < file->knownSize)
+		return false;
+
+	ReadLock fileGuard(file->active->lock);
+	file->knownSize = file->active->size;
+	return file->position >= file->knownSize;
 }
 
 //done
-void FileSystem53::close(int index)
+int FileSystem53::getCurrentPosition(int index)
+{
+	OpenFile* file = oft_entry(index);
+	if (file == NULL)
+		return -1;
+
+	lock_guard<mutex> entryGuard(file->lock);
+	return (int)file->position;
+}
+
+
+// Stress test for the "st" command: 'threads' threads each run 'ops' random create/open/read/write/delete
+// operations against one file system, every thread in a process of its own. Each thread fills its files
+// with its own letter, so a file holding anything else means two threads' data got mixed up.
+// All threads also read one shared file at once. The files live in a scratch directory, which must not
+// exist yet and is removed again. Returns the number of problems found, or -1 if the directory exists.
+static int stress_test(FileSystem53* fs, int threads, int ops)
 {
-	char* fileDescriptors = new char[l];
-	char* buffer = new char[l];
-	char* fileBlock = new char[l];
+	static const char SCRATCH[] = ".st";
+	static const int FILES_PER_THREAD = 3;
+	static const int SHARED_SIZE = 2048;
+	atomic<int> errors(0);
 
-	//clear the "fake buffer"
-	for (int i = 0; i < 64; i++)
+	if (fs->mkdir(SCRATCH) != 0)
+		return -1;
+	const string sharedName = string(SCRATCH) + "/shared";
+	fs->create(sharedName);
+	int shared = fs->open(sharedName);
+	if (shared >= 0)
 	{
-		buffer[i] = '\0';
+		fs->write(shared, 'z', SHARED_SIZE);
+		fs->close(shared);
 	}
 
-	int fileLengthIndex = 0;
-	int length = 0;
+	vector<thread> workers;
+	for (int t = 0; t < threads; t++)
+	{
+		workers.push_back(thread([fs, t, ops, &sharedName, &errors]()
+		{
+			int pid = fs->create_process();
+			fs->switch_process(pid);
+			char letter = (char)('a' + t % 26);
+			uint32_t seed = 2463534242u + t;
+			vector<char> buffer(4096);
+
+			for (int op = 0; op < ops; op++)
+			{
+				// xorshift32
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+
+				stringstream name;
+				name << SCRATCH << "/t" << t << "_" << seed % FILES_PER_THREAD;
+				int length = 1 + (int)(seed >> 8) % (int)buffer.size();
 
-	read_block(1, fileDescriptors);
+				switch ((seed >> 4) % 5)
+				{
+				case 0:
+					fs->create(name.str());
+					break;
+				case 1:
+				{
+					int handle = fs->open(name.str());
+					if (handle < 0)
+						break;
+					fs->write(handle, letter, length);
+					fs->close(handle);
+					break;
+				}
+				case 2:
+				{
+					int handle = fs->open(name.str());
+					if (handle < 0)
+						break;
+					int n;
+					while ((n = fs->read(handle, &buffer[0], (int)buffer.size())) > 0)
+					{
+						for (int i = 0; i < n; i++)
+						{
+							if (buffer[i] != letter)
+							{
+								errors++;
+								break;
+							}
+						}
+					}
+					fs->close(handle);
+					break;
+				}
+				case 3:
+					fs->deleteFile(name.str());
+					break;
+				case 4:
+				{
+					// read a stretch of the shared file in small pieces alongside the other threads
+					int handle = fs->open(sharedName);
+					if (handle < 0)
+						break;
+					fs->lseek(handle, (int)(seed % SHARED_SIZE));
+					int n;
+					for (int piece = 0; piece < 8 && (n = fs->read(handle, &buffer[0], 1 + length % 300)) > 0; piece++)
+					{
+						for (int i = 0; i < n; i++)
+						{
+							if (buffer[i] != 'z')
+							{
+								errors++;
+								break;
+							}
+						}
+					}
+					fs->close(handle);
+					break;
+				}
+				}
+			}
 
-	//currently pointing to file length block in file descriptor
-	int fileDescriptorIndex = OFTable[index][65];
+			if (fs->open_handles() != 0)
+				errors++;
+			fs->exit_process(pid);
+		}));
+	}
 
-	int blockNumber = OFTable[index][64] / l + 1;
-	int fileBlockIndex = fileDescriptors[fileDescriptorIndex + blockNumber];
-	fileLengthIndex = fileDescriptors[fileDescriptorIndex];
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
 
-	int count = 0;
-	while (count < 64 && OFTable[index][count] != '\0')
+	for (int t = 0; t < threads; t++)
 	{
-		buffer[count] = OFTable[index][count];
-		count++;
+		for (int k = 0; k < FILES_PER_THREAD; k++)
+		{
+			stringstream name;
+			name << SCRATCH << "/t" << t << "_" << k;
+			fs->deleteFile(name.str());
+		}
 	}
-	write_block(fileBlockIndex, buffer);
+	fs->deleteFile(sharedName);
+	if (fs->rmdir(SCRATCH) != 0)
+		errors++;
+	return errors;
+}
 
 
-	count = 1;
-	while (fileDescriptors[fileDescriptorIndex + count] != '\0' && count < 4)
+// Allocation benchmark for the "ab" command. For 1, 2, 4, ... 'maxThreads' threads, each thread allocates
+// and frees 'allocations' blocks, 32 at a time, first straight on the lock-free bitmap and then with every
+// call behind one mutex, the way the bitmap used to be guarded. Prints the blocks allocated per second.
+static void allocation_benchmark(FileSystem53* fs, int maxThreads, int allocations)
+{
+	static const int HELD = 32;
+	mutex bitmapMutex;
+
+	for (int threads = 1; threads <= maxThreads; threads *= 2)
 	{
-		read_block(fileDescriptors[fileDescriptorIndex + count], fileBlock);
-		int counter = 0;
-		while (fileBlock[counter] != '\0' && counter < 64)
+		double rate[2];
+		for (int locked = 0; locked < 2; locked++)
 		{
-			length++;
-			counter++;
+			atomic<long long> done(0);
+			vector<thread> workers;
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+			for (int t = 0; t < threads; t++)
+			{
+				workers.push_back(thread([fs, allocations, locked, &bitmapMutex, &done]()
+				{
+					int held[HELD];
+					long long count = 0;
+					for (int round = 0; round < allocations; round += HELD)
+					{
+						int n = 0;
+						for (; n < HELD; n++)
+						{
+							int no;
+							if (locked)
+							{
+								lock_guard<mutex> guard(bitmapMutex);
+								no = fs->allocate_block();
+							}
+							else
+								no = fs->allocate_block();
+							if (no == -1)
+								break;
+							held[n] = no;
+						}
+						count += n;
+
+						for (int i = 0; i < n; i++)
+						{
+							if (locked)
+							{
+								lock_guard<mutex> guard(bitmapMutex);
+								fs->free_block(held[i]);
+							}
+							else
+								fs->free_block(held[i]);
+						}
+					}
+					done += count;
+				}));
+			}
+			for (size_t t = 0; t < workers.size(); t++)
+				workers[t].join();
+
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			rate[locked] = (seconds > 0) ? done / seconds : 0;
 		}
 
-		count++;
+		cout << threads << " threads: lock-free " << (long long)rate[0] << " blocks/s, mutex "
+			<< (long long)rate[1] << " blocks/s" << endl;
 	}
+}
 
-	fileDescriptors[fileDescriptorIndex] = length;
-	write_block(1, fileDescriptors);
-
-	for (int j = 0; j < (l + 2); j++)
-		OFTable[index][j] = '\0';
 
-	oftAllocation[index] = 0;
+// Run 'call' and add how long it took, in nanoseconds, to 'ns'. Returns what the call returned.
+template <typename Call>
+static int timed_call(vector<uint64_t>& ns, Call call)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	int result = call();
+	ns.push_back((uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+	return result;
+}
 
-	delete fileBlock;
-	delete fileDescriptors;
-	delete buffer;
+// Seconds of wall-clock time since 'start'
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
 }
 
-//done
-int FileSystem53::lseek(int index, int pos)
+// Print the latencies of one operation of one "bm" workload as a line of JSON. 'seconds' is the wall-clock
+// time of the whole workload, so the ops_per_sec of its operations add up to the workload's throughput.
+static void report_latencies(const char* workload, int files, const char* op, vector<uint64_t>& ns, double seconds)
 {
-	char* fileDescriptors = new char[l];
-	char* fileBlock = new char[l];
-	char* buffer = new char[l];
-	int newBlockNumber = (pos / l) + 1;
-	int currentBlockNumber = (OFTable[index][64] / l) + 1;
+	if (ns.empty())
+		return;
+
+	sort(ns.begin(), ns.end());
+	uint64_t total = 0;
+	for (size_t i = 0; i < ns.size(); i++)
+		total += ns[i];
+
+	// nearest-rank percentiles
+	const double quantiles[3] = { 0.5, 0.99, 0.999 };
+	uint64_t at[3];
+	for (int q = 0; q < 3; q++)
+	{
+		size_t rank = (size_t)(quantiles[q] * ns.size() + 0.999999);
+		at[q] = ns[(rank > 0) ? rank - 1 : 0];
+	}
 
-	read_block(1, fileDescriptors);
+	cout << "{\"workload\":\"" << workload << "\",\"files\":" << files << ",\"op\":\"" << op
+		<< "\",\"count\":" << ns.size() << ",\"ops_per_sec\":" << (long long)(seconds > 0 ? ns.size() / seconds : 0)
+		<< ",\"mean_ns\":" << total / ns.size()
+		<< ",\"p50_ns\":" << at[0] << ",\"p99_ns\":" << at[1] << ",\"p999_ns\":" << at[2]
+		<< ",\"max_ns\":" << ns.back() << "}" << '\n';
+	ns.clear();
+}
 
-	if (oftAllocation[index] == 0)
-	{
-		delete fileBlock;
-		delete fileDescriptors;
-		delete buffer;
+// Trace benchmark for the "bm" command. Replays synthetic workloads against the API of the mounted disk,
+// in a scratch directory that must not exist yet, and prints one line of JSON per workload and operation with the wall-clock throughput and the mean and p50/p99/p999 latency:
+//   churn       create and delete 'files' files, again and again, for about 'ops' operations
+//   sequential  write one file front to back in 256-byte pieces, lseek to 0 and read it back
+//   random      'ops' lseeks to random positions of that file, each followed by a 64-byte read
+//   directory   open/close, directory() and list() with a quarter, half and all of 'files' files present
+// Everything the benchmark creates is deleted again. Returns the number of calls that failed, or -1 if the
+// scratch directory exists.
+static int trace_benchmark(FileSystem53* fs, int files, int ops)
+{
+	static const char SCRATCH[] = ".bm";
+	static const int SEQUENTIAL_PIECE = 256;
+	static const int RANDOM_PIECE = 64;
+	vector<uint64_t> creates, opens, reads, writes, lseeks, closes, deletes, listings, lists;
+	vector<FileSystem53::DirEntry> entries;
+	int failures = 0;
+	uint32_t seed = 2463534242u;
+	if (files < 1)
+		files = 1;
+	if (fs->mkdir(SCRATCH) != 0)
 		return -1;
-	}
 
-	if (pos > OFTable[index][64])
-		pos = OFTable[index][64];
+	vector<string> names;
+	for (int i = 0; i < files; i++)
+		names.push_back(string(SCRATCH) + "/b" + to_string(i));
+	const string sequentialName = string(SCRATCH) + "/seq";
 
-	if (newBlockNumber != currentBlockNumber)
+	// churn
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int done = 0; done < ops; done += 2 * files)
+	{
+		for (int i = 0; i < files; i++)
+			if (timed_call(creates, [&]() { return fs->create(names[i]); }) != 0)
+				failures++;
+		for (int i = 0; i < files; i++)
+			if (timed_call(deletes, [&]() { return fs->deleteFile(names[i]); }) != 0)
+				failures++;
+	}
+	double seconds = seconds_since(start);
+	report_latencies("churn", files, "create", creates, seconds);
+	report_latencies("churn", files, "deleteFile", deletes, seconds);
+
+	// sequential
+	start = chrono::steady_clock::now();
+	vector<char> piece(SEQUENTIAL_PIECE, 's');
+	int size = 0;
+	if (timed_call(creates, [&]() { return fs->create(sequentialName); }) != 0)
+		failures++;
+	int handle = timed_call(opens, [&]() { return fs->open(sequentialName); });
+	if (handle >= 0)
 	{
-		for (int i = 0; i < 64; i++)
+		for (int i = 0; i < ops; i++)
 		{
-			buffer[i] = OFTable[index][i];
-			OFTable[index][i] = '\0';
+			int n = timed_call(writes, [&]() { return fs->write(handle, &piece[0], piece.size()); });
+			if (n > 0)
+				size += n;
+			if (n != SEQUENTIAL_PIECE)
+				break;
 		}
-		write_block(fileDescriptors[OFTable[index][65] + currentBlockNumber], buffer);
-		read_block(fileDescriptors[OFTable[index][65] + newBlockNumber], buffer);
-		for (int i = 0; i < 64; i++)
+		timed_call(lseeks, [&]() { return fs->lseek(handle, 0); });
+		while (timed_call(reads, [&]() { return fs->read(handle, &piece[0], SEQUENTIAL_PIECE); }) > 0)
+			;
+		timed_call(closes, [&]() { fs->close(handle); return 0; });
+	}
+	else
+		failures++;
+	seconds = seconds_since(start);
+	report_latencies("sequential", 1, "create", creates, seconds);
+	report_latencies("sequential", 1, "open", opens, seconds);
+	report_latencies("sequential", 1, "write", writes, seconds);
+	report_latencies("sequential", 1, "lseek", lseeks, seconds);
+	report_latencies("sequential", 1, "read", reads, seconds);
+	report_latencies("sequential", 1, "close", closes, seconds);
+
+	// random
+	start = chrono::steady_clock::now();
+	handle = timed_call(opens, [&]() { return fs->open(sequentialName); });
+	if (handle >= 0 && size > 0)
+	{
+		for (int i = 0; i < ops; i++)
 		{
-			OFTable[index][i] = buffer[i];
+			// xorshift32
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			int position = (int)(seed % (uint32_t)size);
+			if (timed_call(lseeks, [&]() { return fs->lseek(handle, position); }) != 0)
+				failures++;
+			if (timed_call(reads, [&]() { return fs->read(handle, &piece[0], RANDOM_PIECE); }) <= 0)
+				failures++;
 		}
-		
-
-		OFTable[index][64] = pos;
 	}
-	else if (currentBlockNumber == newBlockNumber)
+	else
+		failures++;
+	if (handle >= 0)
+		timed_call(closes, [&]() { fs->close(handle); return 0; });
+	if (timed_call(deletes, [&]() { return fs->deleteFile(sequentialName); }) != 0)
+		failures++;
+	seconds = seconds_since(start);
+	report_latencies("random", 1, "open", opens, seconds);
+	report_latencies("random", 1, "lseek", lseeks, seconds);
+	report_latencies("random", 1, "read", reads, seconds);
+	report_latencies("random", 1, "close", closes, seconds);
+	report_latencies("random", 1, "deleteFile", deletes, seconds);
+
+	// directory, growing the directory a step at a time
+	int present = 0;
+	for (int step = 4; step >= 1; step /= 2)
 	{
-		OFTable[index][64] = pos;
-	}
+		int count = (files / step > 0) ? files / step : 1;
+		start = chrono::steady_clock::now();
+		for (; present < count; present++)
+			if (timed_call(creates, [&]() { return fs->create(names[present]); }) != 0)
+				failures++;
 
-	delete fileBlock;
-	delete fileDescriptors;
-	delete buffer;
+		for (int i = 0; i < ops; i++)
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			const string& name = names[seed % (uint32_t)count];
+			int h = timed_call(opens, [&]() { return fs->open(name); });
+			if (h < 0)
+			{
+				failures++;
+				continue;
+			}
+			timed_call(closes, [&]() { fs->close(h); return 0; });
+		}
 
-	return 0;
+		// the listing is timed with cout muted
+		streambuf* shown = cout.rdbuf(NULL);
+		for (int i = 0; i < 16; i++)
+			timed_call(listings, [&]() { return fs->directory(SCRATCH); });
+		cout.rdbuf(shown);
+		for (int i = 0; i < 16; i++)
+			timed_call(lists, [&]() { return fs->list(SCRATCH, entries, FileSystem53::LIST_SIZES); });
+
+		seconds = seconds_since(start);
+		report_latencies("directory", count, "create", creates, seconds);
+		report_latencies("directory", count, "open", opens, seconds);
+		report_latencies("directory", count, "close", closes, seconds);
+		report_latencies("directory", count, "directory", listings, seconds);
+		report_latencies("directory", count, "list", lists, seconds);
+	}
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < present; i++)
+		if (timed_call(deletes, [&]() { return fs->deleteFile(names[i]); }) != 0)
+			failures++;
+	report_latencies("directory", present, "deleteFile", deletes, seconds_since(start));
+
+	if (fs->rmdir(SCRATCH) != 0)
+		failures++;
+	return failures;
 }
 
-//done
-int FileSystem53::write(int index, char value, int count)
-{
-	if (oftAllocation[index] == 0)
-		return -1;
-
-	int currentPosition = OFTable[index][64];
-	//right now this index is pointing to file length
-	int fileDescriptorIndex = OFTable[index][65];
-	int fileIndex;
-	int blockNumber = (currentPosition / l) + 1;
-	bool flag = false;
-
-	char* fileDescriptor = new char[l];
-	char* fileBlock = new char[l];
-	char* bytemap = new char[l];
-	char* buffer = new char[l];
 
-	read_block(1, fileDescriptor);
-	read_block(0, bytemap);
+// Commands of the Text.txt script
+enum ScriptCommand
+{
+	CMD_OP, CMD_CL, CMD_RD, CMD_GC, CMD_PC, CMD_WR, CMD_CR, CMD_DE, CMD_SK, CMD_DR, CMD_MD, CMD_RM, CMD_QUIT,
+	CMD_SV, CMD_CM, CMD_CI, CMD_FK, CMD_SW, CMD_EX, CMD_ST, CMD_AB, CMD_BM, CMD_STATS, CMD_LS, CMD_SY, CMD_DD, CMD_CK, CMD_IN
+};
 
-	fileIndex = fileDescriptor[fileDescriptorIndex + blockNumber];
-	read_block(fileIndex, fileBlock);
-	
+// One parsed script line. args[k] is token k + 1 read as a number.
+struct ScriptOp
+{
+	ScriptCommand command;
+	int argCount;   // tokens after the command
+	int args[5];
+	char letter;    // first character of token 2, the character of wr and pc
+	int name;       // token 1 as an index into the script's names, -1 if the command takes no name
+	int span;       // ops from this one on carried out together, 1 if it runs alone
+};
 
-	for (int i = 0; i < count; i++)
+// Parse the script at 'path' into ops, up to the first q. Consecutive rd of one handle, and consecutive
+// wr of one handle, are marked to run as one read or write. Returns false if the file cannot be read.
+static bool parse_script(const char* path, vector<ScriptOp>& ops, vector<string>& names)
+{
+	static const struct { const char* text; ScriptCommand command; bool named; } COMMANDS[] = {
+		{ "op", CMD_OP, true }, { "cl", CMD_CL, false }, { "rd", CMD_RD, false }, { "gc", CMD_GC, false },
+		{ "pc", CMD_PC, false }, { "wr", CMD_WR, false }, { "cr", CMD_CR, true }, { "de", CMD_DE, true },
+		{ "sk", CMD_SK, false }, { "dr", CMD_DR, true }, { "md", CMD_MD, true }, { "rm", CMD_RM, true },
+		{ "q", CMD_QUIT, false }, { "sv", CMD_SV, false }, { "cm", CMD_CM, false }, { "ci", CMD_CI, false },
+		{ "fk", CMD_FK, false }, { "sw", CMD_SW, false }, { "ex", CMD_EX, false }, { "st", CMD_ST, false },
+		{ "ab", CMD_AB, false }, { "bm", CMD_BM, false }, { "stats", CMD_STATS, true }, { "ls", CMD_LS, true }, { "sy", CMD_SY, false }, { "dd", CMD_DD, false }, { "ck", CMD_CK, false },
+		{ "in", CMD_IN, false }
+	};
+	static const int MAX_TOKENS = 6;
+	static const int MAX_RUN_BYTES = 1 << 20;  // bytes one joined read or write may move
+
+	ifstream input(path, ios::binary);
+	if (!input.is_open())
+		return false;
+	string script((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+	script.push_back('\n');
+
+	const char* p = script.c_str();
+	const char* end = p + script.size();
+	int runBytes = 0;
+	while (p < end)
 	{
-		blockNumber = (currentPosition / l) + 1;
-
-		// when block is full and new block needs to be allocated for bytemap and file descriptor
-		if (fileDescriptor[fileDescriptorIndex + blockNumber] == '\0')
+		// split the line into tokens in place
+		const char* token[MAX_TOKENS];
+		size_t length[MAX_TOKENS];
+		int tokens = 0;
+		while (*p != '\n')
 		{
-			int counter = 6;
-			while (counter < 64 && !flag)
+			if (isspace((unsigned char)*p))
 			{
-				counter++;
-				if (bytemap[counter] == '0')
-				{
-					bytemap[counter] = '1';
-					write_block(0, bytemap);
-					flag = true;
-				}
+				p++;
+				continue;
 			}
-
-			fileDescriptor[fileDescriptorIndex + blockNumber] = counter;
-			write_block(1, fileDescriptor);
-
-			//write OFT's buffer into buffer and clear OFT buffer
-			for (int k = 0; k < l; k++)
+			const char* start = p;
+			while (*p != '\n' && !isspace((unsigned char)*p))
+				p++;
+			if (tokens < MAX_TOKENS)
 			{
-				buffer[k] = OFTable[index][k];
-				OFTable[index][k] = '\0';
+				token[tokens] = start;
+				length[tokens] = p - start;
+				tokens++;
 			}
-
-			//write buffer into ldisk
-			//this might error
-			write_block(fileDescriptor[fileDescriptorIndex + blockNumber - 1], buffer);
 		}
+		p++;
+		if (tokens == 0)
+			continue;
+
+		int c = 0;
+		int commands = (int)(sizeof(COMMANDS) / sizeof(COMMANDS[0]));
+		while (c < commands && (strlen(COMMANDS[c].text) != length[0] || memcmp(COMMANDS[c].text, token[0], length[0]) != 0))
+			c++;
+		if (c == commands)
+			continue;
+		if (COMMANDS[c].command == CMD_QUIT)
+			break;
 
-		//only if buffer is empty
-		if (currentPosition < 64)
-			OFTable[index][currentPosition] = value;
-		else if (currentPosition < 128)
-			OFTable[index][currentPosition - 64] = value;
-		else
-			OFTable[index][currentPosition - 128] = value;
+		ScriptOp op;
+		op.command = COMMANDS[c].command;
+		op.argCount = tokens - 1;
+		for (int k = 0; k < 5; k++)
+			op.args[k] = (k + 1 < tokens) ? (int)strtol(token[k + 1], NULL, 10) : 0;
+		op.letter = (tokens > 2) ? token[2][0] : '\0';
+		op.name = -1;
+		op.span = 1;
+		if (COMMANDS[c].named && tokens > 1)
+		{
+			op.name = (int)names.size();
+			names.push_back(string(token[1], length[1]));
+		}
+		else if (COMMANDS[c].named && op.command != CMD_DR)
+		{
+			op.name = (int)names.size();
+			names.push_back(string());
+		}
 
-		OFTable[index][64] = ++currentPosition;
+		// rd <index> <count> and wr <index> <char> <count> of the same handle join the run before them
+		int count = (op.command == CMD_RD) ? op.args[1] : op.args[2];
+		if ((op.command == CMD_RD || op.command == CMD_WR) && count > 0 && !ops.empty())
+		{
+			size_t head = ops.size() - 1;
+			while (ops[head].span == 0)
+				head--;
+			const ScriptOp& last = ops.back();
+			int lastCount = (last.command == CMD_RD) ? last.args[1] : last.args[2];
+			if (last.command == op.command && last.args[0] == op.args[0] && lastCount > 0
+				&& count <= MAX_RUN_BYTES - runBytes)
+			{
+				ops[head].span++;
+				op.span = 0;
+				runBytes += count;
+			}
+			else
+				runBytes = (count <= MAX_RUN_BYTES) ? count : MAX_RUN_BYTES;
+		}
+		ops.push_back(op);
 	}
+	return true;
+}
 
-	int countTemp = 1;
-	int length = 0;
-	while (fileDescriptor[OFTable[index][65] + countTemp] != '\0' && countTemp < 4)
+// Carry out a run of 'span' rd ops of one handle with a single read, then report each op as if it ran alone
+static void script_read(FileSystem53* fs, const ScriptOp* ops, int span, vector<char>& buffer)
+{
+	int total = 0;
+	for (int k = 0; k < span; k++)
+		total += max(ops[k].args[1], 0);
+	buffer.resize((size_t)total + 1);
+	int got = fs->read(ops[0].args[0] - 1, &buffer[0], total);
+
+	int offset = 0;
+	for (int k = 0; k < span; k++)
 	{
-		read_block(fileDescriptor[OFTable[index][65] + countTemp], fileBlock);
-		int counter = 0;
-		while (fileBlock[counter] != '\0' && counter < 64)
+		int count = max(ops[k].args[1], 0);
+		int n = (got < 0) ? -1 : min(max(got - offset, 0), count);
+
+		// an op past the end of file would have found nothing left
+		if (n < 0 || (n == 0 && count > 0))
+			cout << "error" << '\n';
+		else
 		{
-			length++;
-			counter++;
+			cout << n << " bytes read: ";
+			cout.write(&buffer[offset], n);
+			cout << '\n';
 		}
-
-		countTemp++;
+		offset += count;
 	}
-
-	fileDescriptor[OFTable[index][65]] = length;
-	write_block(1, fileDescriptor);
-
-	delete fileBlock;
-	delete fileDescriptor;
-	delete buffer;
-	delete bytemap;
-
-	return 0;
 }
 
-//done
-int FileSystem53::getCurrentPosition(int index)
+// Carry out a run of 'span' wr ops of one handle with a single write, then report each op as if it ran alone
+static void script_write(FileSystem53* fs, const ScriptOp* ops, int span, vector<char>& buffer)
 {
-	return OFTable[index][64];
-}
+	int got;
+	if (span == 1)
+		got = fs->write(ops[0].args[0] - 1, ops[0].letter, ops[0].args[2]);
+	else
+	{
+		buffer.clear();
+		for (int k = 0; k < span; k++)
+			buffer.insert(buffer.end(), (size_t)ops[k].args[2], ops[k].letter);
+		got = fs->write(ops[0].args[0] - 1, &buffer[0], buffer.size());
+	}
 
+	int offset = 0;
+	for (int k = 0; k < span; k++)
+	{
+		int count = max(ops[k].args[2], 0);
+		int n = (got < 0) ? -1 : min(max(got - offset, 0), count);
 
-int main()
-{
-	FileSystem53 *fileSystem = new FileSystem53();
-	string temp = "";
-	ifstream input;
+		// an op after a write that stopped short would have written nothing
+		if (n < 0 || (n == 0 && count > 0))
+			cout << "error" << '\n';
+		else
+			cout << n << " bytes written" << '\n';
+		offset += count;
+	}
+}
 
+// Run parsed script ops against the file system, printing one line of output for each
+static void run_script(FileSystem53* fileSystem, const vector<ScriptOp>& ops, const vector<string>& names)
+{
 	int x, y;
 	int returnedValue = 0;
 	int init = 0;
+	vector<char> buffer;
+	static const string noName;
 
-	input.open("Text.txt");
-
-	while (!input.eof())
+	for (size_t i = 0; i < ops.size(); i += ops[i].span)
 	{
-		getline(input, temp);
-
-		string buffer;
-		stringstream ss(temp);
-
-		vector<string> tokens;
+		const ScriptOp& op = ops[i];
+		const string& name = (op.name >= 0) ? names[op.name] : noName;
+		x = op.args[0];
+		y = op.args[1];
 
-		while (ss >> buffer)
-			tokens.push_back(buffer);
-
-		if (tokens[0] == "op") {
-			returnedValue = fileSystem->open(tokens[1]);
+		switch (op.command)
+		{
+		case CMD_OP:
+			returnedValue = fileSystem->open(name);
 			if (returnedValue > -1)
-				cout << "file " << tokens[1] << " opened, index = " << returnedValue + 1 << endl;
+				cout << "file " << name << " opened, index = " << returnedValue + 1 << '\n';
 			else
-				cout << "error" << endl;
-		}
-		else if (tokens[0] == "cl") {
-			stringstream kk(tokens[1]);
-			kk >> x;
+				cout << "error" << '\n';
+			break;
+		case CMD_CL:
 			fileSystem->close(x-1);
-			cout << "file with index " << x << " closed" << endl;
-		}
-		else if (tokens[0] == "rd") {
-			stringstream kk(tokens[1]);
-			kk >> x;
-			stringstream jj(tokens[2]);
-			jj >> y;
-
-			char* p = new char[64];
-			for (int i = 0; i < 64; i++)
-			{
-				p[i] = '\0';
+			cout << "file with index " << x << " closed" << '\n';
+			break;
+		case CMD_RD:
+			script_read(fileSystem, &op, op.span, buffer);
+			break;
+		case CMD_GC:
+		{
+			// gc <index> <count>: read up to count characters one at a time
+			string text;
+			while ((int)text.size() < y && !fileSystem->feof(x-1)) {
+				int c = fileSystem->fgetc(x-1);
+				if (c == EOF)
+					break;
+				text += (char)c;
 			}
-			returnedValue = fileSystem->read(x-1, p, y);
 
-			if (returnedValue != -1 && returnedValue != -2) {
-				cout << returnedValue << " bytes read: ";
-				for (int r = 0; r < 64; r++)
-					cout << p[r];
-				cout << endl;
-
-				delete p;
-			}
+			if (y > 0 && text.empty())
+				cout << "error" << '\n';
 			else
-				cout << "error" << endl;
+				cout << text.size() << " bytes read: " << text << '\n';
+			break;
 		}
-		else if (tokens[0] == "wr") {
-			stringstream kk(tokens[1]);
-			kk >> x;
-			stringstream jj(tokens[3]);
-			jj >> y;
-
-			returnedValue = fileSystem->write(x-1, tokens[2][0], y);
-			if (returnedValue == 0)
-				cout << y << " bytes written" << endl;
+		case CMD_PC:
+		{
+			// pc <index> <char> <count>: write the character count times, one at a time
+			y = op.args[2];
+			int written = 0;
+			while (written < y && fileSystem->fputc(op.letter, x-1) >= 0)
+				written++;
+
+			if (y > 0 && written == 0)
+				cout << "error" << '\n';
 			else
-				cout << "error" << endl;
+				cout << written << " bytes written" << '\n';
+			break;
 		}
-		else if (tokens[0] == "cr") {
-			returnedValue = fileSystem->create(tokens[1]);
+		case CMD_WR:
+			script_write(fileSystem, &op, op.span, buffer);
+			break;
+		case CMD_CR:
+			returnedValue = fileSystem->create(name);
 			if (returnedValue == 0)
-				cout << "file " << tokens[1] << " created" << endl;
+				cout << "file " << name << " created" << '\n';
 			else
-				cout << "error" << endl;
-		}
-		else if (tokens[0] == "de") {
-			returnedValue = fileSystem->deleteFile(tokens[1]);
+				cout << "error" << '\n';
+			break;
+		case CMD_DE:
+			returnedValue = fileSystem->deleteFile(name);
 			if (returnedValue == 0)
-				cout << "file " << tokens[1] << " deleted" << endl;
+				cout << "file " << name << " deleted" << '\n';
 			else
-				cout << "error" << endl;
-		}
-		else if (tokens[0] == "sk") {
-			stringstream kk(tokens[1]);
-			kk >> x;
-			stringstream jj(tokens[2]);
-			jj >> y;
+				cout << "error" << '\n';
+			break;
+		case CMD_SK:
 			returnedValue = fileSystem->lseek(x-1, y);
 			if (returnedValue == 0)
-				cout << "current position is " << fileSystem->getCurrentPosition(x-1) << endl;
+				cout << "current position is " << fileSystem->getCurrentPosition(x-1) << '\n';
 			else
-				cout << "error" << endl;
-		}
-		else if (tokens[0] == "dr") {
-			fileSystem->directory();
-			cout << endl;
-		}
-		else if (tokens[0] == "q") {
+				cout << "error" << '\n';
+			break;
+		case CMD_DR:
+			// dr [path]
+			if (op.name >= 0)
+				returnedValue = fileSystem->directory(name);
+			else
+			{
+				fileSystem->directory();
+				returnedValue = 0;
+			}
+
+			if (returnedValue == 0)
+				cout << '\n';
+			else
+				cout << "error" << '\n';
+			break;
+		case CMD_LS:
+		{
+			// ls [path]: the listing from list(), with block counts
+			vector<FileSystem53::DirEntry> entries;
+			if (fileSystem->list(name, entries, FileSystem53::LIST_SIZES | FileSystem53::LIST_BLOCKS) == -1)
+			{
+				cout << "error" << '\n';
+				break;
+			}
+			for (size_t e = 0; e < entries.size(); e++)
+			{
+				cout << ((e > 0) ? ", " : "") << entries[e].name << (entries[e].directory ? "/ " : " ") << entries[e].size
+					<< (entries[e].directory ? " entries in " : " bytes in ") << entries[e].blocks << " blocks";
+			}
+			cout << '\n';
 			break;
 		}
-		else if (tokens[0] == "sv") {
+		case CMD_MD:
+			returnedValue = fileSystem->mkdir(name);
+			if (returnedValue == 0)
+				cout << "directory " << name << " created" << '\n';
+			else
+				cout << "error" << '\n';
+			break;
+		case CMD_RM:
+			returnedValue = fileSystem->rmdir(name);
+			if (returnedValue == 0)
+				cout << "directory " << name << " removed" << '\n';
+			else
+				cout << "error" << '\n';
+			break;
+		case CMD_QUIT:
+			return;
+		case CMD_SV:
 			fileSystem->save();
-			cout << "disk saved" << endl;
+			cout << "disk saved" << '\n';
+			break;
+		case CMD_CM:
+			if (fileSystem->commit() == 0)
+				cout << "journal committed" << '\n';
+			else
+				cout << "error" << '\n';
+			break;
+		case CMD_CI:
+			// ci <milliseconds between checkpoints, 0 to stop>
+			if (fileSystem->checkpoint_every(x) != 0)
+				cout << "error" << '\n';
+			else if (x == 0)
+			{
+				cout << "checkpoints stopped";
+				if (fileSystem->checkpoint_failures() != 0)
+					cout << ", " << fileSystem->checkpoint_failures() << " failed";
+				cout << '\n';
+			}
+			else
+				cout << "checkpoint every " << x << " ms" << '\n';
+			break;
+		case CMD_FK:
+			cout << "process " << fileSystem->fork_process() << " created" << '\n';
+			break;
+		case CMD_SW:
+			if (fileSystem->switch_process(x) == 0)
+				cout << "switched to process " << x << '\n';
+			else
+				cout << "error" << '\n';
+			break;
+		case CMD_EX:
+			if (fileSystem->exit_process(x) == 0)
+				cout << "process " << x << " exited" << '\n';
+			else
+				cout << "error" << '\n';
+			break;
+		case CMD_ST:
+			// st <threads> <operations per thread>
+			x = (op.argCount > 0) ? x : 4;
+			y = (op.argCount > 1) ? y : 1000;
+			returnedValue = stress_test(fileSystem, x, y);
+			if (returnedValue < 0)
+				cout << "error" << '\n';
+			else
+				cout << "stress test: " << x << " threads, " << y << " operations each, " << returnedValue << " errors" << '\n';
+			break;
+		case CMD_AB:
+			// ab <max threads> <allocations per thread>
+			x = (op.argCount > 0) ? x : 64;
+			y = (op.argCount > 1) ? y : 100000;
+			allocation_benchmark(fileSystem, x, y);
+			break;
+		case CMD_BM:
+			// bm <files> <operations per workload>
+			x = (op.argCount > 0) ? x : 64;
+			y = (op.argCount > 1) ? y : 10000;
+			returnedValue = trace_benchmark(fileSystem, x, y);
+			if (returnedValue < 0)
+				cout << "error" << '\n';
+			else
+				cout << "trace benchmark: " << returnedValue << " failed calls" << '\n';
+			break;
+		case CMD_STATS:
+		{
+			// stats [reset]
+			FileSystem53::Stats stats = fileSystem->stats();
+			for (int o = 0; o < FileSystem53::STAT_OPS; o++)
+			{
+				cout << FileSystem53::stat_op_name(o) << ": " << stats.calls[o] << " calls, "
+					<< stats.nanoseconds[o] / 1000 << " us" << '\n';
+			}
+			cout << "metadata blocks: " << stats.metaReads << " read, " << stats.metaWrites << " written" << '\n';
+			cout << "data blocks: " << stats.dataReads << " read, " << stats.dataWrites << " written" << '\n';
+			cout << "allocator: " << stats.allocatorScans << " scans, " << stats.allocatorWords << " words" << '\n';
+			cout << "oft reloads: " << stats.oftReloads << '\n';
+			cout << "cache: " << stats.cacheHits << " hits, " << stats.cacheMisses << " misses, "
+				<< stats.cacheWritebacks << " written back" << '\n';
+#if !defined(FS53_STATS)
+			cout << "(built without FS53_STATS, the operation timers stay zero)" << '\n';
+#endif
+			if (name == "reset")
+			{
+				fileSystem->reset_stats();
+				cout << "stats reset" << '\n';
+			}
+			break;
 		}
-		else if (tokens[0] == "in") {
-			if (init == 0) {
-				cout << "disk initialized" << endl;
+		case CMD_SY:
+			fileSystem->sync();
+			cout << "disk synced" << '\n';
+			break;
+		case CMD_DD:
+			// dd <first block> <number of blocks>
+			x = (op.argCount > 0) ? x : 0;
+			y = (op.argCount > 1) ? y : 1;
+			fileSystem->diskdump(x, y);
+			break;
+		case CMD_CK:
+			cout << "checksum " << hex << fileSystem->checksum() << dec << '\n';
+			break;
+		case CMD_IN:
+			// in <block size> <block count> [descriptors [open files [name length]]] formats a new disk
+			if (op.argCount >= 2) {
+				int geometry[5] = { 64, 64, 15, 3, 10 };
+				for (int g = 0; g < op.argCount && g < 5; g++)
+					geometry[g] = op.args[g];
+
+				if (fileSystem->format(geometry[0], geometry[1], geometry[2], geometry[3], geometry[4]) == 0)
+				{
+					cout << "disk initialized" << '\n';
+					init = 1;
+				}
+				else
+					cout << "error" << '\n';
+			}
+			else if (init == 0) {
+				cout << "disk initialized" << '\n';
 				init = 1;
 			}
 			else
 			{
 				fileSystem->restore();
-				cout << "disk restored" << endl;
+				cout << "disk restored" << '\n';
 			}
+			break;
 		}
 	}
+}
+
+
+int main()
+{
+	FileSystem53 *fileSystem = new FileSystem53();
+	vector<ScriptOp> ops;
+	vector<string> names;
 
-	input.close();
+	// the whole script is parsed before the first command runs
+	if (parse_script("Text.txt", ops, names))
+		run_script(fileSystem, ops, names);
+
+	delete fileSystem;
 
 	cout << endl;
 	system("pause");
 	return 0;
-}
\ No newline at end of file
+}